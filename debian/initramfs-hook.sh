@@ -18,3 +18,12 @@ esac
 . /usr/share/initramfs-tools/hook-functions
 
 manual_add_modules thinkpad-wmi
+
+# Settings profiles applied by the driver at probe time
+if [ -d /lib/firmware/thinkpad-wmi ]; then
+	for profile in /lib/firmware/thinkpad-wmi/*; do
+		if [ -f "$profile" ]; then
+			copy_file firmware "$profile"
+		fi
+	done
+fi
@@ -26,26 +26,105 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <asm/msr.h>
+#include <asm/tsc.h>
+#include <crypto/hash.h>
 #include <linux/acpi.h>
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/capability.h>
+#include <linux/cpumask.h>
+#include <linux/ctype.h>
 #include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/dmi.h>
+#include <linux/firmware.h>
+#include <linux/hashtable.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/version.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/ratelimit.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/stringhash.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 #include <linux/wmi.h>
 #include <linux/acpi.h>
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0))
+#include <crypto/sha2.h>
+#else
+#include <crypto/sha.h>
+#endif
+
 #define	THINKPAD_WMI_FILE	"thinkpad-wmi"
 
+/* rdmsrl_safe() is rdmsrq_safe() since 6.16 */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0))
+#define thinkpad_wmi_rdmsr_safe	rdmsrq_safe
+#else
+#define thinkpad_wmi_rdmsr_safe	rdmsrl_safe
+#endif
+
+/*
+ * bin_attribute callbacks take a const attribute since 6.13, through
+ * read_new() until 6.16.
+ */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+#define THINKPAD_WMI_BIN_ATTR_CONST const
+#else
+#define THINKPAD_WMI_BIN_ATTR_CONST
+#endif
+
 MODULE_AUTHOR("Corentin Chary <corentin.chary@gmail.com>");
 MODULE_DESCRIPTION("Thinkpad WMI Driver");
 MODULE_LICENSE("GPL");
 
+static bool value_cache;
+module_param(value_cache, bool, 0444);
+MODULE_PARM_DESC(value_cache, "Serve setting reads from known values instead "
+		 "of calling the firmware (default: false)");
+
+static char *profile;
+module_param(profile, charp, 0444);
+MODULE_PARM_DESC(profile, "Firmware file with 'Item=Value' lines to apply at "
+		 "probe (default: thinkpad-wmi/<product name>.conf)");
+
+static unsigned int max_empty;
+module_param(max_empty, uint, 0444);
+MODULE_PARM_DESC(max_empty, "Stop discovery after this many empty instances "
+		 "in a row (default: 0, never)");
+
+static char *housekeeping;
+module_param(housekeeping, charp, 0444);
+MODULE_PARM_DESC(housekeeping, "CPUs to run firmware calls on, as a list "
+		 "(default: the calling CPU)");
+
+static char *replay;
+module_param(replay, charp, 0444);
+MODULE_PARM_DESC(replay, "Firmware file with a trace recorded through debugfs "
+		 "to answer firmware calls from, instead of the firmware");
+
+static char *layout;
+module_param(layout, charp, 0444);
+MODULE_PARM_DESC(layout, "Firmware file with the settings layout exported "
+		 "by a previous boot (default: thinkpad-wmi/<product name>.layout)");
+
 /* WMI inteface */
 
 /**
@@ -247,6 +326,86 @@ enum {
  * in thinkpad_wmi_probe */
 MODULE_ALIAS("wmi:"LENOVO_BIOS_SETTING_GUID);
 
+/* Firmware operations, for accounting */
+enum thinkpad_wmi_op {
+	THINKPAD_WMI_OP_BIOS_SETTING,
+	THINKPAD_WMI_OP_PLATFORM_SETTING,
+	THINKPAD_WMI_OP_GET_SELECTIONS,
+	THINKPAD_WMI_OP_SET,
+	THINKPAD_WMI_OP_SET_PLATFORM,
+	THINKPAD_WMI_OP_SAVE,
+	THINKPAD_WMI_OP_DISCARD,
+	THINKPAD_WMI_OP_LOAD_DEFAULT,
+	THINKPAD_WMI_OP_SET_PASSWORD,
+	THINKPAD_WMI_OP_PASSWORD_SETTINGS,
+	THINKPAD_WMI_OP_MAX
+};
+
+static const char * const thinkpad_wmi_op_names[THINKPAD_WMI_OP_MAX] = {
+	[THINKPAD_WMI_OP_BIOS_SETTING]		= "bios_setting",
+	[THINKPAD_WMI_OP_PLATFORM_SETTING]	= "platform_setting",
+	[THINKPAD_WMI_OP_GET_SELECTIONS]	= "get_bios_selections",
+	[THINKPAD_WMI_OP_SET]			= "set_bios_settings",
+	[THINKPAD_WMI_OP_SET_PLATFORM]		= "set_platform_settings",
+	[THINKPAD_WMI_OP_SAVE]			= "save_bios_settings",
+	[THINKPAD_WMI_OP_DISCARD]		= "discard_bios_settings",
+	[THINKPAD_WMI_OP_LOAD_DEFAULT]		= "load_default",
+	[THINKPAD_WMI_OP_SET_PASSWORD]		= "set_bios_password",
+	[THINKPAD_WMI_OP_PASSWORD_SETTINGS]	= "bios_password_settings",
+};
+
+/*
+ * Interactive calls (single setting accesses, writes) go ahead of bulk ones
+ * (discovery, dumps of all the settings).
+ */
+enum thinkpad_wmi_prio {
+	THINKPAD_WMI_PRIO_INTERACTIVE,
+	THINKPAD_WMI_PRIO_BULK,
+};
+
+/*
+ * SMIs stop all CPUs, so the cost of a call is also counted in SMIs (from
+ * MSR_SMI_COUNT, when the CPU has it and the caller did not migrate) and in
+ * TSC cycles.
+ */
+struct thinkpad_wmi_call_stats {
+	u64 calls;
+	u64 errors;
+	u64 total_ns;
+	u64 max_ns;
+	u64 smis;
+	u64 unsampled;
+	u64 cycles;
+};
+
+/*
+ * Audit log of committed changes. Writers never block: they claim a slot
+ * by bumping head and publish the entry by setting its seq to index + 1.
+ * The reader consumes entries from tail, and skips the ones overwritten
+ * before it got to them.
+ */
+#define THINKPAD_WMI_AUDIT_ENTRIES	64
+
+struct thinkpad_wmi_audit_entry {
+	u64 seq;
+	u64 timestamp;
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+	char name[64];
+	char old_value[64];
+	char new_value[64];
+};
+
+struct thinkpad_wmi_audit {
+	atomic64_t head;
+	/* Reader side, protected by lock */
+	struct mutex lock;
+	u64 tail;
+	u64 dropped;
+	/* THINKPAD_WMI_AUDIT_ENTRIES, apart from struct thinkpad_wmi */
+	struct thinkpad_wmi_audit_entry *entries;
+};
+
 struct thinkpad_wmi_pcfg {
 	uint32_t password_mode;
 	uint32_t password_state;
@@ -256,6 +415,15 @@ struct thinkpad_wmi_pcfg {
 	uint32_t supported_keyboard;
 };
 
+/* password_state bits */
+#define THINKPAD_WMI_PASSWORD_POP	BIT(0)
+#define THINKPAD_WMI_PASSWORD_PAP	BIT(1)
+#define THINKPAD_WMI_PASSWORD_HDD	BIT(2)
+
+/* supported_encodings bits */
+#define THINKPAD_WMI_ENCODING_ASCII	BIT(0)
+#define THINKPAD_WMI_ENCODING_SCANCODE	BIT(1)
+
 /*
  * thinkpad_wmi/       - debugfs root directory
  *   bios_settings
@@ -270,23 +438,114 @@ struct thinkpad_wmi_pcfg {
  *   instance
  *   instance_count
  *   bios_password_settings
+ *   call_stats
+ *   get_setting
+ *   set_setting
+ *   discovery_latency
+ *   smi_stats
+ *   session
+ *   record
+ *   trace
+ *   trace_dropped
  */
+
+/* Argument of the debugfs files, the global one or a session's own */
+struct thinkpad_wmi_debug_args {
+	struct thinkpad_wmi *thinkpad;
+	u8 instance;
+	char argument[512];
+};
+
 struct thinkpad_wmi_debug {
 	struct dentry *root;
 
 	int instances_count;
-	u8 instance;
-	char argument[512];
+	struct thinkpad_wmi_debug_args args;
+};
+
+/*
+ * A setting discovered at probe time. value is the last value read from or
+ * committed to the firmware, NULL when unknown (e.g. after load default).
+ * choices is the list of valid values, kept from the last firmware read.
+ * baseline is the desired value loaded by the administrator, if any.
+ * snapshot is the value before the last change of several settings, or at
+ * the last explicit snapshot.
+ * suspect is set on restore from hibernation: value and choices may have
+ * been changed in the BIOS setup meanwhile, until read again.
+ */
+struct thinkpad_wmi_setting {
+	char *name;
+	char *value;
+	char *choices;
+	char *baseline;
+	char *snapshot;
+	bool drift;
+	bool suspect;
+	struct hlist_node node;
+};
+
+/*
+ * Table of the settings that can be mapped by userspace, see the table file.
+ * Entries are indexed by instance. seq is odd while the driver updates the
+ * table: readers copy what they need and retry if seq was odd or changed.
+ */
+#define THINKPAD_WMI_TABLE_MAGIC	0x54575054 /* "TPWT" */
+#define THINKPAD_WMI_TABLE_VERSION	1
+
+#define THINKPAD_WMI_ENTRY_PRESENT	BIT(0)
+#define THINKPAD_WMI_ENTRY_KNOWN	BIT(1)	/* value is valid */
+#define THINKPAD_WMI_ENTRY_TRUNCATED	BIT(2)	/* name or value cut */
+#define THINKPAD_WMI_ENTRY_SUSPECT	BIT(3)	/* not read since restore */
+
+struct thinkpad_wmi_table_entry {
+	char name[64];
+	char value[64];
+	s16 choice;	/* index of value in the choices, -1 if unknown */
+	u16 flags;
+	u32 reserved;
+};
+
+struct thinkpad_wmi_table {
+	u32 magic;
+	u32 version;
+	u32 seq;
+	u32 count;
+	u32 entry_size;
+	u32 reserved[3];
+	struct thinkpad_wmi_table_entry entries[LENOVO_MAX_SETTINGS];
+};
+
+/* Outcome of the last profile applied */
+struct thinkpad_wmi_apply_stats {
+	int result;
+	int changed;
+	int unchanged;
+	int passes;
+	u64 parse_ns;
+	u64 stage_ns;
+	u64 commit_ns;
 };
 
 struct thinkpad_wmi {
 	struct wmi_device *wmi_device;
 
+	/*
+	 * Serializes firmware transactions (set then save or discard) and
+	 * protects the auth strings, the debugfs argument, setting values
+	 * and baseline.
+	 */
+	struct mutex lock;
+	/* Serializes rescans, taken before lock */
+	struct mutex rescan_lock;
+
 	char password[64];
 	char password_encoding[64];
 	char password_kbdlang[4]; /* 2 bytes for \n\0 */
 	char auth_string[256];
 	char password_type[64];
+	/* Password settings, read on first use */
+	struct thinkpad_wmi_pcfg pcfg;
+	bool pcfg_valid;
 
 	bool can_set_bios_settings;
 	bool can_discard_bios_settings;
@@ -295,9 +554,63 @@ struct thinkpad_wmi {
 	bool can_set_bios_password;
 	bool can_get_password_settings;
 
-	char *settings[LENOVO_MAX_SETTINGS];
+	struct thinkpad_wmi_setting settings[LENOVO_MAX_SETTINGS];
+	/* First instance past the settings, where discovery stopped */
+	int settings_end;
+	/* Time spent querying each instance by the last discovery */
+	u64 discovery_ns[LENOVO_MAX_SETTINGS];
+	/* settings by name, rebuilt after each discovery */
+	DECLARE_HASHTABLE(settings_hash, 7);
+	bool value_cache;
+	/*
+	 * Firmware reads on behalf of users without CAP_SYS_ADMIN, and how
+	 * many were refused, protected by lock.
+	 */
+	struct ratelimit_state read_limit;
+	unsigned long read_throttled;
+	int drift_count;
+	/* SHA-256 of the sorted 'Item=Value' lines, valid until a value changes */
+	struct crypto_shash *digest_tfm;
+	u8 config_digest[SHA256_DIGEST_SIZE];
+	bool config_digest_valid;
+	char profile_status[128];
+	struct thinkpad_wmi_apply_stats apply_stats;
+	/* Instances in the order they could be set, learned by apply */
+	u8 apply_order[LENOVO_MAX_SETTINGS];
+	int apply_order_len;
 	struct dev_ext_attribute *devattrs;
 	struct thinkpad_wmi_debug debug;
+	/* Last listing of the settings file, see read_settings() */
+	char *listing;
+	size_t listing_len;
+
+	/* Firmware call dispatcher, see thinkpad_wmi_call() */
+	struct mutex call_lock;
+	atomic_t interactive_calls;
+	wait_queue_head_t bulk_wait;
+	/* CPUs to run the calls on, empty for any. Protected by call_lock */
+	cpumask_var_t housekeeping;
+
+	spinlock_t call_stats_lock;
+	struct thinkpad_wmi_call_stats call_stats[THINKPAD_WMI_OP_MAX];
+
+	/* Trace of the calls when record is set, written under call_lock */
+	bool record;
+	struct kfifo trace;
+	struct mutex trace_lock;
+	u64 trace_dropped;
+	/* Calls answered from a trace instead of the firmware */
+	struct thinkpad_wmi_replay *replay;
+
+	struct thinkpad_wmi_audit audit;
+
+	/* Mapped by userspace, written with lock held */
+	struct thinkpad_wmi_table *table;
+
+	/* Reads back suspect settings after restore, see generation */
+	struct work_struct revalidate_work;
+	unsigned int generation;
+	int suspect_changed;
 };
 
 /* helpers */
@@ -333,7 +646,489 @@ static int thinkpad_wmi_extract_error(const struct acpi_buffer *output)
 	return ret;
 }
 
-static int thinkpad_wmi_simple_call(const char *guid,
+/*
+ * Record and replay
+ *
+ * Each call is traced as a line:
+ *   op instance latency_ns status input type output
+ * with input and output in hex ('-' if none) and type 's' for a string,
+ * 'b' for a buffer, 'i' for an integer or '-'. Inputs are cut before the
+ * first password. A trace can then be replayed: calls are answered with the
+ * recorded output and latency of the next record of the same op, instance
+ * and input.
+ */
+#define THINKPAD_WMI_TRACE_SIZE		SZ_64K
+
+struct thinkpad_wmi_replay_record {
+	enum thinkpad_wmi_op op;
+	u8 instance;
+	u64 latency_ns;
+	acpi_status status;
+	u8 *input;
+	size_t input_len;
+	char type;
+	u8 *output;
+	size_t output_len;
+	u64 integer;
+};
+
+struct thinkpad_wmi_replay {
+	struct thinkpad_wmi_replay_record *records;
+	int count;
+	/* Next record to look from, protected by call_lock */
+	int cursor;
+};
+
+/*
+ * Length of the input before the first password, which is not traced.
+ * Inputs of operations not known to be safe are not traced at all.
+ */
+static size_t thinkpad_wmi_redacted_len(enum thinkpad_wmi_op op,
+					const struct acpi_buffer *input)
+{
+	const char *data = input->pointer;
+	int fields;
+	size_t i;
+
+	switch (op) {
+	case THINKPAD_WMI_OP_GET_SELECTIONS:
+		return input->length; /* Item */
+	case THINKPAD_WMI_OP_SET:
+	case THINKPAD_WMI_OP_SET_PLATFORM:
+		fields = 2; /* Item,Value */
+		break;
+	case THINKPAD_WMI_OP_SET_PASSWORD:
+		fields = 1; /* Type */
+		break;
+	default:
+		return 0; /* May be only a password */
+	}
+
+	for (i = 0; i < input->length; i++) {
+		if (data[i] == ',' && !--fields)
+			return i;
+	}
+	return input->length;
+}
+
+/* Append hex of data to p, or '-' when empty */
+static char *thinkpad_wmi_trace_hex(char *p, const void *data, size_t len)
+{
+	if (!len) {
+		*p++ = '-';
+		return p;
+	}
+	return bin2hex(p, data, len);
+}
+
+static void thinkpad_wmi_trace_call(struct thinkpad_wmi *thinkpad,
+				    enum thinkpad_wmi_op op, u8 instance,
+				    const struct acpi_buffer *input,
+				    const struct acpi_buffer *output,
+				    acpi_status status, u64 latency)
+{
+	const union acpi_object *obj = NULL;
+	size_t input_len = 0, output_len = 0, len;
+	const void *data = NULL;
+	char type = '-', *line, *p;
+
+	if (input)
+		input_len = thinkpad_wmi_redacted_len(op, input);
+	if (ACPI_SUCCESS(status) && output)
+		obj = output->pointer;
+
+	if (obj && obj->type == ACPI_TYPE_STRING) {
+		type = 's';
+		data = obj->string.pointer;
+		output_len = obj->string.length;
+	} else if (obj && obj->type == ACPI_TYPE_BUFFER) {
+		type = 'b';
+		data = obj->buffer.pointer;
+		output_len = obj->buffer.length;
+	} else if (obj && obj->type == ACPI_TYPE_INTEGER) {
+		type = 'i';
+		data = &obj->integer.value;
+		output_len = sizeof(obj->integer.value);
+	}
+
+	line = kmalloc(96 + 2 * (input_len + output_len), GFP_KERNEL);
+	if (!line) {
+		thinkpad->trace_dropped++;
+		return;
+	}
+
+	p = line + sprintf(line, "%s %u %llu %u ", thinkpad_wmi_op_names[op],
+			   instance, latency, status);
+	p = thinkpad_wmi_trace_hex(p, input ? input->pointer : NULL,
+				   input_len);
+	p += sprintf(p, " %c ", type);
+	p = thinkpad_wmi_trace_hex(p, data, output_len);
+	*p++ = '\n';
+	len = p - line;
+
+	if (kfifo_avail(&thinkpad->trace) >= len)
+		kfifo_in(&thinkpad->trace, line, len);
+	else
+		thinkpad->trace_dropped++;
+	kfree(line);
+}
+
+static int thinkpad_wmi_parse_hex(const char *hex, u8 **data, size_t *len)
+{
+	*data = NULL;
+	*len = 0;
+	if (!strcmp(hex, "-"))
+		return 0;
+	if (strlen(hex) % 2)
+		return -EINVAL;
+
+	*len = strlen(hex) / 2;
+	*data = kmalloc(*len, GFP_KERNEL);
+	if (!*data)
+		return -ENOMEM;
+	return hex2bin(*data, hex, *len);
+}
+
+static int thinkpad_wmi_parse_record(struct thinkpad_wmi_replay_record *rec,
+				     char *line)
+{
+	char *fields[7];
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		fields[i] = strsep(&line, " ");
+		if (!fields[i] || !*fields[i])
+			return -EINVAL;
+	}
+
+	ret = match_string(thinkpad_wmi_op_names, THINKPAD_WMI_OP_MAX,
+			   fields[0]);
+	if (ret < 0)
+		return ret;
+	rec->op = ret;
+
+	if (kstrtou8(fields[1], 10, &rec->instance) ||
+	    kstrtou64(fields[2], 10, &rec->latency_ns) ||
+	    kstrtou32(fields[3], 10, &rec->status) || strlen(fields[5]) != 1)
+		return -EINVAL;
+	rec->type = fields[5][0];
+
+	ret = thinkpad_wmi_parse_hex(fields[4], &rec->input, &rec->input_len);
+	if (ret)
+		return ret;
+	ret = thinkpad_wmi_parse_hex(fields[6], &rec->output, &rec->output_len);
+	if (ret)
+		return ret;
+
+	switch (rec->type) {
+	case 'i':
+		if (rec->output_len != sizeof(rec->integer))
+			return -EINVAL;
+		memcpy(&rec->integer, rec->output, sizeof(rec->integer));
+		break;
+	case 's':
+	case 'b':
+	case '-':
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void thinkpad_wmi_free_replay(struct thinkpad_wmi_replay *replay)
+{
+	int i;
+
+	if (!replay)
+		return;
+	for (i = 0; i < replay->count; i++) {
+		kfree(replay->records[i].input);
+		kfree(replay->records[i].output);
+	}
+	kvfree(replay->records);
+	kfree(replay);
+}
+
+static int thinkpad_wmi_load_replay(struct thinkpad_wmi *thinkpad)
+{
+	struct device *dev = &thinkpad->wmi_device->dev;
+	struct thinkpad_wmi_replay *replay_data;
+	const struct firmware *fw;
+	char *data, *line, *p;
+	int count = 0, ret;
+
+	if (!replay || !*replay)
+		return 0;
+
+	ret = request_firmware(&fw, replay, dev);
+	if (ret)
+		return ret;
+
+	data = kmemdup_nul((const char *)fw->data, fw->size, GFP_KERNEL);
+	release_firmware(fw);
+	if (!data)
+		return -ENOMEM;
+
+	for (p = data; *p; p++) {
+		if (*p == '\n')
+			count++;
+	}
+
+	ret = -ENOMEM;
+	replay_data = kzalloc(sizeof(*replay_data), GFP_KERNEL);
+	if (!replay_data)
+		goto end;
+	replay_data->records = kvcalloc(count + 1,
+					sizeof(*replay_data->records),
+					GFP_KERNEL);
+	if (!replay_data->records)
+		goto end;
+
+	p = data;
+	ret = 0;
+	while (!ret && (line = strsep(&p, "\n"))) {
+		if (!*strim(line))
+			continue;
+		ret = thinkpad_wmi_parse_record(
+			&replay_data->records[replay_data->count++], line);
+	}
+	if (ret) {
+		pr_err("Invalid record %d in %s\n", replay_data->count, replay);
+		goto end;
+	}
+
+	pr_info("Replaying %d calls from %s\n", replay_data->count, replay);
+	thinkpad->replay = replay_data;
+	replay_data = NULL;
+end:
+	thinkpad_wmi_free_replay(replay_data);
+	kfree(data);
+	return ret;
+}
+
+/* Build the ACPI object of a record, in one allocation like ACPICA does */
+static union acpi_object *
+thinkpad_wmi_replay_object(const struct thinkpad_wmi_replay_record *rec,
+			   size_t *size)
+{
+	union acpi_object *obj;
+
+	*size = sizeof(*obj) + rec->output_len + 1;
+	obj = kzalloc(*size, GFP_KERNEL);
+	if (!obj)
+		return NULL;
+
+	switch (rec->type) {
+	case 's':
+		obj->type = ACPI_TYPE_STRING;
+		obj->string.length = rec->output_len;
+		obj->string.pointer = (char *)(obj + 1);
+		memcpy(obj->string.pointer, rec->output, rec->output_len);
+		break;
+	case 'b':
+		obj->type = ACPI_TYPE_BUFFER;
+		obj->buffer.length = rec->output_len;
+		obj->buffer.pointer = (u8 *)(obj + 1);
+		memcpy(obj->buffer.pointer, rec->output, rec->output_len);
+		break;
+	case 'i':
+		obj->type = ACPI_TYPE_INTEGER;
+		obj->integer.value = rec->integer;
+		break;
+	}
+	return obj;
+}
+
+/* Answer a call from the trace, called with call_lock held */
+static acpi_status thinkpad_wmi_replay_call(struct thinkpad_wmi *thinkpad,
+					    enum thinkpad_wmi_op op,
+					    u8 instance,
+					    const struct acpi_buffer *input,
+					    struct acpi_buffer *output)
+{
+	struct thinkpad_wmi_replay *replay = thinkpad->replay;
+	const struct thinkpad_wmi_replay_record *rec = NULL;
+	size_t input_len = input ? thinkpad_wmi_redacted_len(op, input) : 0;
+	union acpi_object *obj;
+	size_t size;
+	int i, n;
+
+	for (i = 0; i < replay->count; i++) {
+		n = (replay->cursor + i) % replay->count;
+		if (replay->records[n].op == op &&
+		    replay->records[n].instance == instance &&
+		    replay->records[n].input_len == input_len &&
+		    !memcmp(replay->records[n].input, input ? input->pointer : "",
+			    input_len)) {
+			rec = &replay->records[n];
+			replay->cursor = n + 1;
+			break;
+		}
+	}
+	if (!rec)
+		return AE_NOT_FOUND;
+
+	usleep_range(div_u64(rec->latency_ns, NSEC_PER_USEC),
+		     div_u64(rec->latency_ns, NSEC_PER_USEC) + 10);
+
+	if (ACPI_FAILURE(rec->status) || rec->type == '-')
+		return rec->status;
+
+	obj = thinkpad_wmi_replay_object(rec, &size);
+	if (!obj)
+		return AE_NO_MEMORY;
+	output->pointer = obj;
+	output->length = size;
+	return rec->status;
+}
+
+/* In replay, the methods are the ones of the trace */
+static bool thinkpad_wmi_has_guid(struct thinkpad_wmi *thinkpad,
+				  const char *guid)
+{
+	return thinkpad->replay || wmi_has_guid(guid);
+}
+
+/* A firmware call and what it cost, see thinkpad_wmi_evaluate() */
+struct thinkpad_wmi_work {
+	const char *guid;
+	u8 instance;
+	const struct acpi_buffer *input;
+	struct acpi_buffer *output;
+	/* Housekeeping CPU the call was queued on, see thinkpad_wmi_call() */
+	unsigned int cpu;
+
+	u64 delta;
+	u64 cycles;
+	u64 smis;
+	bool sampled;
+};
+
+static long thinkpad_wmi_evaluate(void *data)
+{
+	struct thinkpad_wmi_work *work = data;
+	u64 start, smi_start, smi_end;
+	acpi_status status;
+	int cpu;
+
+	cpu = raw_smp_processor_id();
+	work->sampled = !thinkpad_wmi_rdmsr_safe(MSR_SMI_COUNT, &smi_start);
+	work->cycles = rdtsc_ordered();
+	start = ktime_get_ns();
+	if (work->input)
+		status = wmi_evaluate_method(work->guid, work->instance, 0,
+					     work->input, work->output);
+	else
+		status = wmi_query_block(work->guid, work->instance,
+					 work->output);
+	work->delta = ktime_get_ns() - start;
+	work->cycles = rdtsc_ordered() - work->cycles;
+	/* The count is per CPU */
+	work->sampled = work->sampled && cpu == raw_smp_processor_id() &&
+			!thinkpad_wmi_rdmsr_safe(MSR_SMI_COUNT, &smi_end);
+	if (work->sampled)
+		work->smis = smi_end - smi_start;
+
+	return status;
+}
+
+/* -EAGAIN when the housekeeping CPU went offline before the call ran */
+static long thinkpad_wmi_evaluate_on(void *data)
+{
+	struct thinkpad_wmi_work *work = data;
+
+	if (raw_smp_processor_id() != work->cpu)
+		return -EAGAIN;
+	return thinkpad_wmi_evaluate(work);
+}
+
+/*
+ * Every firmware call goes through here: input is NULL to query instance
+ * of a data block, otherwise the method of the block is evaluated. The
+ * time spent in firmware is accounted per operation.
+ *
+ * Calls are dispatched one at a time. Bulk calls wait until no interactive
+ * call is pending, so a sweep over all the settings yields between each of
+ * its calls and a single read or write only waits for one bulk call.
+ */
+static acpi_status thinkpad_wmi_call(struct thinkpad_wmi *thinkpad,
+				     enum thinkpad_wmi_op op,
+				     enum thinkpad_wmi_prio prio,
+				     const char *guid, u8 instance,
+				     const struct acpi_buffer *input,
+				     struct acpi_buffer *output)
+{
+	struct thinkpad_wmi_call_stats *stats = &thinkpad->call_stats[op];
+	struct thinkpad_wmi_work work = {
+		.guid = guid,
+		.instance = instance,
+		.input = input,
+		.output = output,
+	};
+	acpi_status status;
+
+	if (prio == THINKPAD_WMI_PRIO_INTERACTIVE) {
+		atomic_inc(&thinkpad->interactive_calls);
+	} else {
+		cond_resched();
+		wait_event(thinkpad->bulk_wait,
+			   !atomic_read(&thinkpad->interactive_calls));
+	}
+	mutex_lock(&thinkpad->call_lock);
+
+	/*
+	 * Keep the AML interpreter off isolated CPUs: unless the caller is on
+	 * a housekeeping CPU, run the call on one and wait for it. Hotplug is
+	 * not held off across the call: if that CPU goes offline before the
+	 * work runs, the call is made from the calling CPU instead.
+	 */
+	if (thinkpad->replay) {
+		work.delta = ktime_get_ns();
+		status = thinkpad_wmi_replay_call(thinkpad, op, instance, input,
+						  output);
+		work.delta = ktime_get_ns() - work.delta;
+	} else {
+		long ret = -EAGAIN;
+
+		work.cpu = cpumask_any_and(thinkpad->housekeeping,
+					   cpu_online_mask);
+		if (work.cpu < nr_cpu_ids &&
+		    !cpumask_test_cpu(raw_smp_processor_id(),
+				      thinkpad->housekeeping))
+			ret = work_on_cpu(work.cpu, thinkpad_wmi_evaluate_on,
+					  &work);
+		status = ret == -EAGAIN ? thinkpad_wmi_evaluate(&work) : ret;
+	}
+
+	if (READ_ONCE(thinkpad->record))
+		thinkpad_wmi_trace_call(thinkpad, op, instance, input, output,
+					status, work.delta);
+
+	spin_lock(&thinkpad->call_stats_lock);
+	stats->calls++;
+	if (ACPI_FAILURE(status))
+		stats->errors++;
+	stats->total_ns += work.delta;
+	stats->max_ns = max(stats->max_ns, work.delta);
+	stats->cycles += work.cycles;
+	if (work.sampled)
+		stats->smis += work.smis;
+	else
+		stats->unsampled++;
+	spin_unlock(&thinkpad->call_stats_lock);
+
+	mutex_unlock(&thinkpad->call_lock);
+	if (prio == THINKPAD_WMI_PRIO_INTERACTIVE &&
+	    atomic_dec_and_test(&thinkpad->interactive_calls))
+		wake_up_all(&thinkpad->bulk_wait);
+
+	return status;
+}
+
+static int thinkpad_wmi_simple_call(struct thinkpad_wmi *thinkpad,
+				    enum thinkpad_wmi_op op,
+				    const char *guid,
 				    const char *arg)
 {
 	const struct acpi_buffer input = { strlen(arg), (char *)arg };
@@ -344,8 +1139,13 @@ static int thinkpad_wmi_simple_call(const char *guid,
 	 * duplicated call required to match bios workaround for behavior
 	 * seen when WMI accessed via scripting on other OS
 	 */
-	status = wmi_evaluate_method(guid, 0, 0, &input, &output);
-	status = wmi_evaluate_method(guid, 0, 0, &input, &output);
+	status = thinkpad_wmi_call(thinkpad, op, THINKPAD_WMI_PRIO_INTERACTIVE,
+				   guid, 0, &input, &output);
+	kfree(output.pointer);
+	output.length = ACPI_ALLOCATE_BUFFER;
+	output.pointer = NULL;
+	status = thinkpad_wmi_call(thinkpad, op, THINKPAD_WMI_PRIO_INTERACTIVE,
+				   guid, 0, &input, &output);
 
 	if (ACPI_FAILURE(status))
 		return -EIO;
@@ -367,38 +1167,59 @@ static int thinkpad_wmi_extract_output_string(const struct acpi_buffer *output,
 	return *string ? 0 : -ENOMEM;
 }
 
-static int thinkpad_wmi_bios_setting(int item, char **value)
+static int thinkpad_wmi_bios_setting(struct thinkpad_wmi *thinkpad,
+				     enum thinkpad_wmi_prio prio,
+				     int item, char **value)
 {
 	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
 	acpi_status status;
 
-	status = wmi_query_block(LENOVO_BIOS_SETTING_GUID, item, &output);
+	status = thinkpad_wmi_call(thinkpad, THINKPAD_WMI_OP_BIOS_SETTING, prio,
+				   LENOVO_BIOS_SETTING_GUID, item, NULL,
+				   &output);
 	if (ACPI_FAILURE(status))
 		return -EIO;
 
 	return thinkpad_wmi_extract_output_string(&output, value);
 }
 
-static int thinkpad_wmi_platform_setting(int item, char **value)
+static int thinkpad_wmi_platform_setting(struct thinkpad_wmi *thinkpad,
+					 enum thinkpad_wmi_prio prio,
+					 int item, char **value)
 {
 	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
 	acpi_status status;
 
-	status = wmi_query_block(LENOVO_PLATFORM_SETTING_GUID, item, &output);
+	status = thinkpad_wmi_call(thinkpad, THINKPAD_WMI_OP_PLATFORM_SETTING,
+				   prio, LENOVO_PLATFORM_SETTING_GUID, item,
+				   NULL, &output);
 	if (ACPI_FAILURE(status))
 		return -EIO;
 
 	return thinkpad_wmi_extract_output_string(&output, value);
 }
 
-static int thinkpad_wmi_get_bios_selections(const char *item, char **value)
+static int thinkpad_wmi_get_bios_selections(struct thinkpad_wmi *thinkpad,
+					    enum thinkpad_wmi_prio prio,
+					    const char *item, char **value)
 {
-	const struct acpi_buffer input = { strlen(item), (char *)item };
 	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	struct acpi_buffer input;
 	acpi_status status;
+	char *name;
+
+	/* The firmware only knows the names with '/' */
+	name = kstrdup(item, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+	strreplace(name, '\\', '/');
 
-	status = wmi_evaluate_method(LENOVO_GET_BIOS_SELECTIONS_GUID,
-				     0, 0, &input, &output);
+	input.length = strlen(name);
+	input.pointer = name;
+	status = thinkpad_wmi_call(thinkpad, THINKPAD_WMI_OP_GET_SELECTIONS,
+				   prio, LENOVO_GET_BIOS_SELECTIONS_GUID, 0,
+				   &input, &output);
+	kfree(name);
 
 	if (ACPI_FAILURE(status))
 		return -EIO;
@@ -406,50 +1227,65 @@ static int thinkpad_wmi_get_bios_selections(const char *item, char **value)
 	return thinkpad_wmi_extract_output_string(&output, value);
 }
 
-static int thinkpad_wmi_set_bios_settings(const char *settings)
+static int thinkpad_wmi_set_bios_settings(struct thinkpad_wmi *thinkpad,
+					  const char *settings)
 {
-	return thinkpad_wmi_simple_call(LENOVO_SET_BIOS_SETTINGS_GUID,
+	return thinkpad_wmi_simple_call(thinkpad, THINKPAD_WMI_OP_SET,
+					LENOVO_SET_BIOS_SETTINGS_GUID,
 					settings);
 }
 
-static int thinkpad_wmi_set_platform_settings(const char *settings)
+static int thinkpad_wmi_set_platform_settings(struct thinkpad_wmi *thinkpad,
+					      const char *settings)
 {
-	return thinkpad_wmi_simple_call(LENOVO_SET_PLATFORM_SETTINGS_GUID,
+	return thinkpad_wmi_simple_call(thinkpad, THINKPAD_WMI_OP_SET_PLATFORM,
+					LENOVO_SET_PLATFORM_SETTINGS_GUID,
 					settings);
 }
 
-static int thinkpad_wmi_save_bios_settings(const char *password)
+static int thinkpad_wmi_save_bios_settings(struct thinkpad_wmi *thinkpad,
+					   const char *password)
 {
-	return thinkpad_wmi_simple_call(LENOVO_SAVE_BIOS_SETTINGS_GUID,
+	return thinkpad_wmi_simple_call(thinkpad, THINKPAD_WMI_OP_SAVE,
+					LENOVO_SAVE_BIOS_SETTINGS_GUID,
 					password);
 }
 
-static int thinkpad_wmi_discard_bios_settings(const char *password)
+static int thinkpad_wmi_discard_bios_settings(struct thinkpad_wmi *thinkpad,
+					      const char *password)
 {
-	return thinkpad_wmi_simple_call(LENOVO_DISCARD_BIOS_SETTINGS_GUID,
+	return thinkpad_wmi_simple_call(thinkpad, THINKPAD_WMI_OP_DISCARD,
+					LENOVO_DISCARD_BIOS_SETTINGS_GUID,
 					password);
 }
 
-static int thinkpad_wmi_load_default(const char *password)
+static int thinkpad_wmi_load_default(struct thinkpad_wmi *thinkpad,
+				     const char *password)
 {
-	return thinkpad_wmi_simple_call(LENOVO_LOAD_DEFAULT_SETTINGS_GUID,
+	return thinkpad_wmi_simple_call(thinkpad, THINKPAD_WMI_OP_LOAD_DEFAULT,
+					LENOVO_LOAD_DEFAULT_SETTINGS_GUID,
 					password);
 }
 
-static int thinkpad_wmi_set_bios_password(const char *settings)
+static int thinkpad_wmi_set_bios_password(struct thinkpad_wmi *thinkpad,
+					  const char *settings)
 {
-	return thinkpad_wmi_simple_call(LENOVO_SET_BIOS_PASSWORD_GUID,
+	return thinkpad_wmi_simple_call(thinkpad, THINKPAD_WMI_OP_SET_PASSWORD,
+					LENOVO_SET_BIOS_PASSWORD_GUID,
 					settings);
 }
 
-static int thinkpad_wmi_password_settings(struct thinkpad_wmi_pcfg *pcfg)
+static int thinkpad_wmi_password_settings(struct thinkpad_wmi *thinkpad,
+					  struct thinkpad_wmi_pcfg *pcfg)
 {
 	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
 	const union acpi_object *obj;
 	acpi_status status;
 
-	status = wmi_query_block(LENOVO_BIOS_PASSWORD_SETTINGS_GUID, 0,
-				 &output);
+	status = thinkpad_wmi_call(thinkpad, THINKPAD_WMI_OP_PASSWORD_SETTINGS,
+				   THINKPAD_WMI_PRIO_INTERACTIVE,
+				   LENOVO_BIOS_PASSWORD_SETTINGS_GUID, 0, NULL,
+				   &output);
 	if (ACPI_FAILURE(status))
 		return -EIO;
 
@@ -478,297 +1314,2200 @@ static int thinkpad_wmi_password_settings(struct thinkpad_wmi_pcfg *pcfg)
 	return 0;
 }
 
-/* sysfs */
+/* Audit log */
 
-#define to_ext_attr(x) container_of(x, struct dev_ext_attribute, attr)
+static void thinkpad_wmi_audit(struct thinkpad_wmi *thinkpad,
+			       const char *name, const char *old_value,
+			       const char *new_value)
+{
+	struct thinkpad_wmi_audit *audit = &thinkpad->audit;
+	struct thinkpad_wmi_audit_entry *entry;
+	u64 index;
+
+	index = atomic64_inc_return(&audit->head) - 1;
+	entry = &audit->entries[index % THINKPAD_WMI_AUDIT_ENTRIES];
+
+	WRITE_ONCE(entry->seq, 0);
+	smp_wmb();
+	entry->timestamp = ktime_get_real_ns();
+	entry->pid = task_tgid_nr(current);
+	get_task_comm(entry->comm, current);
+	strscpy(entry->name, name, sizeof(entry->name));
+	strscpy(entry->old_value, old_value ? : "?", sizeof(entry->old_value));
+	strscpy(entry->new_value, new_value ? : "", sizeof(entry->new_value));
+	smp_store_release(&entry->seq, index + 1);
+}
 
-static ssize_t show_setting(struct device *dev,
-			    struct device_attribute *attr,
-			    char *buf)
+/* Consume as many entries as fit in buf, a page. */
+static ssize_t thinkpad_wmi_audit_read(struct thinkpad_wmi *thinkpad,
+				       char *buf)
 {
-	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
-	struct dev_ext_attribute *ea = to_ext_attr(attr);
-	int item = (uintptr_t)ea->var;
-	char *name = thinkpad->settings[item];
-	char *settings = NULL, *choices = NULL, *value;
+	struct thinkpad_wmi_audit *audit = &thinkpad->audit;
+	struct thinkpad_wmi_audit_entry entry;
 	ssize_t count = 0;
-	int ret;
+	u64 head, seq, sec;
+	u32 nsec;
+	int len;
+
+	mutex_lock(&audit->lock);
+	head = atomic64_read(&audit->head);
+	if (head - audit->tail > THINKPAD_WMI_AUDIT_ENTRIES) {
+		audit->dropped += head - audit->tail -
+				  THINKPAD_WMI_AUDIT_ENTRIES;
+		audit->tail = head - THINKPAD_WMI_AUDIT_ENTRIES;
+	}
 
-	ret = thinkpad_wmi_bios_setting(item, &settings);
-	if (ret)
-		return ret;
-	if (!settings)
-		return -EIO;
+	while (audit->tail < head) {
+		struct thinkpad_wmi_audit_entry *slot;
 
-	if (thinkpad->can_get_bios_selections) {
-		ret = thinkpad_wmi_get_bios_selections(name, &choices);
-		if (ret)
-			goto error;
-		if (!choices || !*choices) {
-			ret = -EIO;
-			goto error;
+		slot = &audit->entries[audit->tail % THINKPAD_WMI_AUDIT_ENTRIES];
+		seq = smp_load_acquire(&slot->seq);
+		if (seq == 0)
+			break; /* Still being written */
+
+		entry = *slot;
+		smp_rmb();
+		if (seq != audit->tail + 1 || READ_ONCE(slot->seq) != seq) {
+			/* Overwritten by a newer entry */
+			audit->dropped++;
+			audit->tail++;
+			continue;
 		}
+
+		sec = div_u64_rem(entry.timestamp, NSEC_PER_SEC, &nsec);
+		len = snprintf(buf + count, PAGE_SIZE - count,
+			       "%llu.%09u %d %s %s %s %s\n",
+			       sec, nsec, entry.pid,
+			       entry.comm, entry.name, entry.old_value,
+			       entry.new_value);
+		if (len >= PAGE_SIZE - count)
+			break; /* Keep it for the next read */
+		count += len;
+		audit->tail++;
 	}
+	mutex_unlock(&audit->lock);
 
-	value = strchr(settings, ',');
-	if (!value)
-		goto error;
-	value++;
+	return count;
+}
 
-	count = sprintf(buf, "%s\n", value);
-	if (choices)
-		count += sprintf(buf + count, "%s\n", choices);
+/* Settings state */
 
-error:
-	kfree(settings);
-	kfree(choices);
-	return ret ? ret : count;
+/* Setting names are exposed with '\' instead of '/', accept both. */
+static bool thinkpad_wmi_name_eq(const char *a, const char *b)
+{
+	for (; *a && *b; a++, b++) {
+		if (*a == *b)
+			continue;
+		if ((*a == '/' || *a == '\\') && (*b == '/' || *b == '\\'))
+			continue;
+		return false;
+	}
+	return *a == *b;
 }
 
-static ssize_t store_setting(struct device *dev,
-			      struct device_attribute *attr,
-			      const char *buf, size_t count)
+/* Hash of the name as the firmware knows it, with '/' */
+static u32 thinkpad_wmi_name_hash(const char *name)
 {
-	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
-	struct dev_ext_attribute *ea = to_ext_attr(attr);
-	int item_idx = (uintptr_t)ea->var;
-	char *item = thinkpad->settings[item_idx];
-	int ret;
-	size_t buffer_size;
-	char *buffer;
+	unsigned long hash = init_name_hash(NULL);
 
-	/* Convert '\' to '/'. Please have a look at thinkpad_wmi_analyze. */
-	int spleng = 0;
-	int num = 0;
-	spleng = strlen(item);
-	for (num = 0; num < spleng; num++) {
-		if (item[num] == '\\')
-			item[num] = '/';
+	for (; *name; name++)
+		hash = partial_name_hash(*name == '\\' ? '/' : *name, hash);
+	return end_name_hash(hash);
+}
+
+/* Index of value in a comma separated list of choices, -1 if not found */
+static int thinkpad_wmi_choice_index(const char *choices, const char *value)
+{
+	size_t len = strlen(value);
+	const char *p = choices;
+	int index = 0;
+
+	while (p) {
+		if (!strncmp(p, value, len) && (p[len] == ',' || !p[len]))
+			return index;
+		p = strchr(p, ',');
+		if (p)
+			p++;
+		index++;
 	}
+	return -1;
+}
 
-	/* Format: 'Item,Value,Authstring;' */
-	buffer_size = (strlen(item) + 1 + count + 1 +
-		       sizeof(thinkpad->auth_string) + 2);
-	buffer = kmalloc(buffer_size, GFP_KERNEL);
-	if (!buffer)
+static void thinkpad_wmi_fill_entry(struct thinkpad_wmi *thinkpad, int item)
+{
+	struct thinkpad_wmi_table_entry *entry = &thinkpad->table->entries[item];
+	struct thinkpad_wmi_setting *setting = &thinkpad->settings[item];
+
+	memset(entry, 0, sizeof(*entry));
+	entry->choice = -1;
+	if (!setting->name)
+		return;
+
+	entry->flags = THINKPAD_WMI_ENTRY_PRESENT;
+	if (setting->suspect)
+		entry->flags |= THINKPAD_WMI_ENTRY_SUSPECT;
+	if (strscpy(entry->name, setting->name, sizeof(entry->name)) < 0)
+		entry->flags |= THINKPAD_WMI_ENTRY_TRUNCATED;
+	if (!setting->value)
+		return;
+
+	entry->flags |= THINKPAD_WMI_ENTRY_KNOWN;
+	if (strscpy(entry->value, setting->value, sizeof(entry->value)) < 0)
+		entry->flags |= THINKPAD_WMI_ENTRY_TRUNCATED;
+	if (setting->choices)
+		entry->choice = thinkpad_wmi_choice_index(setting->choices,
+							  setting->value);
+}
+
+static void thinkpad_wmi_table_begin(struct thinkpad_wmi_table *table)
+{
+	WRITE_ONCE(table->seq, table->seq + 1);
+	smp_wmb();
+}
+
+static void thinkpad_wmi_table_end(struct thinkpad_wmi_table *table)
+{
+	smp_wmb();
+	WRITE_ONCE(table->seq, table->seq + 1);
+}
+
+/* Update the table entry of a setting, called with lock held */
+static void thinkpad_wmi_update_table(struct thinkpad_wmi *thinkpad, int item)
+{
+	if (!thinkpad->table)
+		return;
+
+	thinkpad_wmi_table_begin(thinkpad->table);
+	thinkpad_wmi_fill_entry(thinkpad, item);
+	thinkpad_wmi_table_end(thinkpad->table);
+}
+
+static void thinkpad_wmi_fill_table(struct thinkpad_wmi *thinkpad)
+{
+	int i;
+
+	if (!thinkpad->table)
+		return;
+
+	thinkpad_wmi_table_begin(thinkpad->table);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++)
+		thinkpad_wmi_fill_entry(thinkpad, i);
+	thinkpad_wmi_table_end(thinkpad->table);
+}
+
+static void thinkpad_wmi_hash_settings(struct thinkpad_wmi *thinkpad)
+{
+	int i;
+
+	thinkpad->config_digest_valid = false;
+	hash_init(thinkpad->settings_hash);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (setting->name)
+			hash_add(thinkpad->settings_hash, &setting->node,
+				 thinkpad_wmi_name_hash(setting->name));
+	}
+	thinkpad_wmi_fill_table(thinkpad);
+}
+
+static int thinkpad_wmi_find_setting(struct thinkpad_wmi *thinkpad,
+				     const char *name)
+{
+	struct thinkpad_wmi_setting *setting;
+
+	hash_for_each_possible(thinkpad->settings_hash, setting, node,
+			       thinkpad_wmi_name_hash(name)) {
+		if (thinkpad_wmi_name_eq(setting->name, name))
+			return setting - thinkpad->settings;
+	}
+	return -ENOENT;
+}
+
+static void thinkpad_wmi_check_drift(struct thinkpad_wmi *thinkpad, int item)
+{
+	struct thinkpad_wmi_setting *setting = &thinkpad->settings[item];
+	bool drift;
+
+	if (!setting->baseline)
+		drift = false;
+	else if (!setting->value)
+		return; /* Unknown, evaluated again once read back */
+	else
+		drift = strcmp(setting->value, setting->baseline) != 0;
+
+	if (drift == setting->drift)
+		return;
+
+	setting->drift = drift;
+	thinkpad->drift_count += drift ? 1 : -1;
+	sysfs_notify(&thinkpad->wmi_device->dev.kobj, NULL, "drift_count");
+}
+
+/* Record the value of a setting, NULL if it is not known anymore. */
+static int thinkpad_wmi_set_value(struct thinkpad_wmi *thinkpad, int item,
+				  const char *value)
+{
+	struct thinkpad_wmi_setting *setting = &thinkpad->settings[item];
+	char *copy = NULL;
+
+	if (value) {
+		copy = kstrdup(value, GFP_KERNEL);
+		if (!copy)
+			return -ENOMEM;
+	}
+
+	if (!value || !setting->value || strcmp(value, setting->value))
+		thinkpad->config_digest_valid = false;
+	/* Changed behind our back, e.g. in the BIOS setup while hibernated */
+	if (setting->suspect && value && setting->value &&
+	    strcmp(value, setting->value))
+		thinkpad->suspect_changed++;
+	kfree(setting->value);
+	setting->value = copy;
+	thinkpad_wmi_check_drift(thinkpad, item);
+	thinkpad_wmi_update_table(thinkpad, item);
+	return 0;
+}
+
+static void thinkpad_wmi_invalidate_values(struct thinkpad_wmi *thinkpad)
+{
+	int i;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++)
+		thinkpad_wmi_set_value(thinkpad, i, NULL);
+}
+
+/* Number of instances of the settings block, as far as the WMI core knows */
+static int thinkpad_wmi_instance_count(struct thinkpad_wmi *thinkpad)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0))
+	u8 count = wmidev_instance_count(thinkpad->wmi_device);
+
+	if (count)
+		return min_t(int, count, LENOVO_MAX_SETTINGS);
+#endif
+	return LENOVO_MAX_SETTINGS;
+}
+
+/*
+ * Query every instance to find the settings present on this machine.
+ * settings[] is indexed by instance and gets the name and current value.
+ */
+static int thinkpad_wmi_discover(struct thinkpad_wmi *thinkpad,
+				 struct thinkpad_wmi_setting *settings)
+{
+	int i, count, settings_count = 0;
+	unsigned int empty = 0;
+	u64 start;
+
+	memset(thinkpad->discovery_ns, 0, sizeof(thinkpad->discovery_ns));
+	count = thinkpad_wmi_instance_count(thinkpad);
+
+	/* Try to find the number of valid settings on this machine. */
+	for (i = 0; i < count; i++) {
+		char *item = NULL;
+		char *p;
+		int ret;
+
+		start = ktime_get_ns();
+		ret = thinkpad_wmi_bios_setting(thinkpad, THINKPAD_WMI_PRIO_BULK,
+						i, &item);
+		thinkpad->discovery_ns[i] = ktime_get_ns() - start;
+		if (ret)
+			break;
+		if (!item)
+			break;
+		if (!*item) {
+			kfree(item);
+			if (max_empty && ++empty >= max_empty)
+				break;
+			continue;
+		}
+		empty = 0;
+
+		/* Remove the value part, and keep it as the known value */
+		p = strchr(item, ',');
+		if (p) {
+			*p = '\0';
+			settings[i].value = kstrdup(p + 1, GFP_KERNEL);
+		}
+
+		/* It is not allowed to have '/' for file name. Convert it into '\'. */
+		strreplace(item, '/', '\\');
+		settings[i].name = item; /* Cache setting name */
+		settings_count++;
+	}
+	thinkpad->settings_end = i;
+	thinkpad->debug.instances_count = i;
+
+	return settings_count;
+}
+
+static void thinkpad_wmi_flush_cache(struct thinkpad_wmi *thinkpad)
+{
+	int i;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		kfree(thinkpad->settings[i].choices);
+		thinkpad->settings[i].choices = NULL;
+	}
+	thinkpad->pcfg_valid = false;
+	/* Updates the table too */
+	thinkpad_wmi_invalidate_values(thinkpad);
+}
+
+/*
+ * Each query is an SMI that stalls all CPUs, so the reads of unprivileged
+ * users are rate limited. Unprivileged reads are expected here, they must
+ * not be logged as denials. Called with lock held.
+ */
+static bool thinkpad_wmi_may_read(struct thinkpad_wmi *thinkpad)
+{
+	if (has_capability_noaudit(current, CAP_SYS_ADMIN) ||
+	    __ratelimit(&thinkpad->read_limit))
+		return true;
+
+	thinkpad->read_throttled++;
+	return false;
+}
+
+/* Read back the value of a setting from the firmware, with lock held */
+static int thinkpad_wmi_fetch_value(struct thinkpad_wmi *thinkpad, int item,
+				    enum thinkpad_wmi_prio prio)
+{
+	struct thinkpad_wmi_setting *setting = &thinkpad->settings[item];
+	char *settings = NULL, *value;
+	int ret;
+
+	if (!thinkpad_wmi_may_read(thinkpad))
+		return -EAGAIN;
+
+	ret = thinkpad_wmi_bios_setting(thinkpad, prio, item, &settings);
+	if (ret)
+		return ret;
+
+	value = settings ? strchr(settings, ',') : NULL;
+	if (!value)
+		ret = -EIO;
+	else
+		ret = thinkpad_wmi_set_value(thinkpad, item, value + 1);
+
+	/* Fresh now, the choices are read again on first use */
+	if (!ret && setting->suspect) {
+		kfree(setting->choices);
+		setting->choices = NULL;
+		setting->suspect = false;
+		thinkpad_wmi_update_table(thinkpad, item);
+	}
+
+	kfree(settings);
+	return ret;
+}
+
+/*
+ * Read the unknown values of all settings, or only of the ones in the
+ * baseline, before a sweep over the settings. These are bulk calls and lock
+ * is dropped after each one, so single reads and writes get in between.
+ * Called without lock; errors are left to the sweep.
+ */
+static void thinkpad_wmi_fetch_unknown(struct thinkpad_wmi *thinkpad,
+				       bool baseline_only)
+{
+	int i;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		mutex_lock(&thinkpad->lock);
+		if (setting->name && (setting->baseline || !baseline_only) &&
+		    (!setting->value || setting->suspect))
+			thinkpad_wmi_fetch_value(thinkpad, i,
+						 THINKPAD_WMI_PRIO_BULK);
+		mutex_unlock(&thinkpad->lock);
+		cond_resched();
+	}
+}
+
+static int thinkpad_wmi_cmp_settings(const void *a, const void *b)
+{
+	const struct thinkpad_wmi_setting *const *x = a, *const *y = b;
+
+	return strcmp((*x)->name, (*y)->name);
+}
+
+/*
+ * Hash the 'Item=Value' lines sorted by name, as in the settings file, with
+ * lock held. The values are read beforehand by thinkpad_wmi_fetch_unknown(),
+ * EAGAIN if one is still unknown.
+ */
+static int thinkpad_wmi_update_digest(struct thinkpad_wmi *thinkpad)
+{
+	SHASH_DESC_ON_STACK(desc, thinkpad->digest_tfm);
+	struct thinkpad_wmi_setting **sorted;
+	int i, count = 0, ret;
+
+	if (!thinkpad->digest_tfm)
+		return -ENODEV;
+	if (thinkpad->config_digest_valid)
+		return 0;
+
+	sorted = kcalloc(LENOVO_MAX_SETTINGS, sizeof(*sorted), GFP_KERNEL);
+	if (!sorted)
+		return -ENOMEM;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (!setting->name)
+			continue;
+		if (!setting->value) {
+			ret = -EAGAIN;
+			goto end;
+		}
+		sorted[count++] = setting;
+	}
+	sort(sorted, count, sizeof(*sorted), thinkpad_wmi_cmp_settings, NULL);
+
+	desc->tfm = thinkpad->digest_tfm;
+	ret = crypto_shash_init(desc);
+	for (i = 0; !ret && i < count; i++) {
+		struct thinkpad_wmi_setting *setting = sorted[i];
+
+		ret = crypto_shash_update(desc, setting->name,
+					  strlen(setting->name));
+		ret = ret ? : crypto_shash_update(desc, "=", 1);
+		ret = ret ? : crypto_shash_update(desc, setting->value,
+						  strlen(setting->value));
+		ret = ret ? : crypto_shash_update(desc, "\n", 1);
+	}
+	ret = ret ? : crypto_shash_final(desc, thinkpad->config_digest);
+	shash_desc_zero(desc);
+	thinkpad->config_digest_valid = !ret;
+
+end:
+	kfree(sorted);
+	return ret;
+}
+
+/*
+ * Parse a 'Item=Value' per line list into values[], indexed by instance.
+ * Empty lines and lines starting with '#' are ignored. data is modified.
+ */
+static int thinkpad_wmi_parse_profile(struct thinkpad_wmi *thinkpad,
+				      char *data, char **values)
+{
+	char *line, *value;
+	int item;
+
+	while ((line = strsep(&data, "\n"))) {
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+
+		value = strchr(line, '=');
+		if (!value)
+			return -EINVAL;
+		*value++ = '\0';
+
+		item = thinkpad_wmi_find_setting(thinkpad, strim(line));
+		if (item < 0) {
+			pr_debug("Unknown setting '%s'\n", line);
+			return -EINVAL;
+		}
+
+		kfree(values[item]);
+		values[item] = kstrdup(strim(value), GFP_KERNEL);
+		if (!values[item])
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Stage a new value for a setting, it only takes effect once saved.
+ * Format: 'Item,Value,Authstring;'
+ */
+static int thinkpad_wmi_stage_setting(struct thinkpad_wmi *thinkpad, int item,
+				      const char *value)
+{
+	const char *name = thinkpad->settings[item].name;
+	size_t buffer_size;
+	char *buffer, *p;
+	int ret;
+
+	buffer_size = (strlen(name) + 1 + strlen(value) + 1 +
+		       sizeof(thinkpad->auth_string) + 2);
+	buffer = kmalloc(buffer_size, GFP_KERNEL);
+	if (!buffer)
 		return -ENOMEM;
 
-	strcpy(buffer, item);
+	strcpy(buffer, name);
+	/* Convert '\' to '/'. Please have a look at thinkpad_wmi_analyze. */
+	for (p = buffer; *p; p++) {
+		if (*p == '\\')
+			*p = '/';
+	}
 	strcat(buffer, ",");
-	strncat(buffer, buf, count);
-	if (count)
-		strim(buffer);
+	strcat(buffer, value);
 	if (*thinkpad->auth_string) {
 		strcat(buffer, ",");
 		strcat(buffer, thinkpad->auth_string);
 	}
-	strcat(buffer, ";");
+	strcat(buffer, ";");
+
+	ret = thinkpad_wmi_set_bios_settings(thinkpad, buffer);
+	kfree(buffer);
+	return ret;
+}
+
+/* Set and save a single setting, called with lock held */
+static int thinkpad_wmi_commit_setting(struct thinkpad_wmi *thinkpad,
+				       int item, const char *value)
+{
+	int ret;
+
+	ret = thinkpad_wmi_stage_setting(thinkpad, item, value);
+	if (ret)
+		return ret;
+
+	ret = thinkpad_wmi_save_bios_settings(thinkpad, thinkpad->auth_string);
+	if (ret) {
+		/* Try to discard the settings if we failed to apply them. */
+		thinkpad_wmi_discard_bios_settings(thinkpad,
+						   thinkpad->auth_string);
+		return ret;
+	}
+
+	thinkpad_wmi_audit(thinkpad, thinkpad->settings[item].name,
+			   thinkpad->settings[item].value, value);
+	thinkpad_wmi_set_value(thinkpad, item, value);
+	return 0;
+}
+
+/*
+ * Put the instances staged by the last apply, in their order, in front of
+ * the known order.
+ */
+static void thinkpad_wmi_learn_order(struct thinkpad_wmi *thinkpad,
+				     const u8 *order, int count)
+{
+	DECLARE_BITMAP(seen, LENOVO_MAX_SETTINGS);
+	u8 learned[LENOVO_MAX_SETTINGS];
+	int i, len = 0;
+
+	bitmap_zero(seen, LENOVO_MAX_SETTINGS);
+	for (i = 0; i < count; i++) {
+		learned[len++] = order[i];
+		__set_bit(order[i], seen);
+	}
+	for (i = 0; i < thinkpad->apply_order_len; i++) {
+		if (!test_bit(thinkpad->apply_order[i], seen))
+			learned[len++] = thinkpad->apply_order[i];
+	}
+
+	memcpy(thinkpad->apply_order, learned, len);
+	thinkpad->apply_order_len = len;
+}
+
+/*
+ * Parse the names of an apply order, one per line, called with lock held.
+ * Unknown and repeated settings are rejected.
+ */
+static int thinkpad_wmi_parse_order(struct thinkpad_wmi *thinkpad, char *data)
+{
+	DECLARE_BITMAP(seen, LENOVO_MAX_SETTINGS);
+	u8 order[LENOVO_MAX_SETTINGS];
+	int item, len = 0;
+	char *line;
+
+	bitmap_zero(seen, LENOVO_MAX_SETTINGS);
+	while ((line = strsep(&data, "\n"))) {
+		line = strim(line);
+		if (!*line)
+			continue;
+
+		item = thinkpad_wmi_find_setting(thinkpad, line);
+		if (item < 0 || __test_and_set_bit(item, seen))
+			return -EINVAL;
+		order[len++] = item;
+	}
+
+	memcpy(thinkpad->apply_order, order, len);
+	thinkpad->apply_order_len = len;
+	return 0;
+}
+
+/*
+ * Apply a profile ('Item=Value' lines) as a single transaction: only the
+ * settings that differ from their known value are staged, then everything
+ * is saved once. Pending changes are discarded on error. The outcome and
+ * the time spent in each phase are kept in apply_stats.
+ *
+ * Some settings are Invalid until another one is changed. Those are staged
+ * again in later passes of the same transaction, as long as a pass stages
+ * something, and the order that worked is kept for the next profiles.
+ *
+ * The previous values of the changed settings replace the snapshot, so the
+ * whole change can be rolled back. They are read first, like in
+ * thinkpad_wmi_fetch_unknown(), and a rescan waits for the end of the apply.
+ */
+static int thinkpad_wmi_apply_profile(struct thinkpad_wmi *thinkpad,
+				      char *data)
+{
+	struct thinkpad_wmi_apply_stats *stats = &thinkpad->apply_stats;
+	DECLARE_BITMAP(queued, LENOVO_MAX_SETTINGS);
+	int i, ret, count = 0, done, nr = 0;
+	char **values, **snapshot;
+	u64 start, parse_ns;
+	u8 *order;
+
+	values = kcalloc(LENOVO_MAX_SETTINGS, sizeof(*values), GFP_KERNEL);
+	snapshot = kcalloc(LENOVO_MAX_SETTINGS, sizeof(*snapshot), GFP_KERNEL);
+	order = kcalloc(LENOVO_MAX_SETTINGS, sizeof(*order), GFP_KERNEL);
+	if (!values || !snapshot || !order) {
+		kfree(values);
+		kfree(snapshot);
+		kfree(order);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&thinkpad->rescan_lock);
+	mutex_lock(&thinkpad->lock);
+	start = ktime_get_ns();
+	ret = thinkpad_wmi_parse_profile(thinkpad, data, values);
+	parse_ns = ktime_get_ns() - start;
+	mutex_unlock(&thinkpad->lock);
+
+	/* The previous values are needed for the snapshot */
+	start = ktime_get_ns();
+	for (i = 0; !ret && i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (!values[i])
+			continue;
+		mutex_lock(&thinkpad->lock);
+		if (!setting->value || setting->suspect)
+			thinkpad_wmi_fetch_value(thinkpad, i,
+						 THINKPAD_WMI_PRIO_BULK);
+		mutex_unlock(&thinkpad->lock);
+		cond_resched();
+	}
+
+	mutex_lock(&thinkpad->lock);
+	memset(stats, 0, sizeof(*stats));
+	stats->parse_ns = parse_ns;
+	if (ret)
+		goto end;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		const char *value = thinkpad->settings[i].value;
+
+		if (values[i] && value && !strcmp(value, values[i])) {
+			kfree(values[i]);
+			values[i] = NULL;
+			stats->unchanged++;
+		}
+	}
+
+	/* Copy the previous values now, nothing is staged yet */
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		const char *value = thinkpad->settings[i].value;
+
+		if (!values[i] || !value)
+			continue;
+		snapshot[i] = kstrdup(value, GFP_KERNEL);
+		if (!snapshot[i]) {
+			ret = -ENOMEM;
+			goto end;
+		}
+	}
+
+	/* Known order first, then the others by instance */
+	bitmap_zero(queued, LENOVO_MAX_SETTINGS);
+	for (i = 0; i < thinkpad->apply_order_len; i++) {
+		u8 item = thinkpad->apply_order[i];
+
+		if (values[item]) {
+			order[nr++] = item;
+			__set_bit(item, queued);
+		}
+	}
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		if (values[i] && !test_bit(i, queued))
+			order[nr++] = i;
+	}
+
+	/* order[0..count) are staged, the others are left for the next pass */
+	while (count < nr) {
+		done = count;
+		stats->passes++;
+		for (i = count; i < nr; i++) {
+			ret = thinkpad_wmi_stage_setting(thinkpad, order[i],
+							 values[order[i]]);
+			if (ret == THINKPAD_WMI_INVALID)
+				continue;
+			if (ret) {
+				pr_debug("Failed to stage %s=%s: %d\n",
+					 thinkpad->settings[order[i]].name,
+					 values[order[i]], ret);
+				goto staged;
+			}
+			swap(order[count], order[i]);
+			count++;
+		}
+		if (count == done)
+			break;
+	}
+
+	ret = 0;
+	for (i = count; i < nr; i++) {
+		pr_debug("Failed to stage %s=%s: invalid\n",
+			 thinkpad->settings[order[i]].name, values[order[i]]);
+		ret = THINKPAD_WMI_INVALID;
+	}
+
+staged:
+	stats->stage_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	if (!ret && count)
+		ret = thinkpad_wmi_save_bios_settings(thinkpad,
+						      thinkpad->auth_string);
+	if (ret)
+		thinkpad_wmi_discard_bios_settings(thinkpad,
+						   thinkpad->auth_string);
+	stats->commit_ns = ktime_get_ns() - start;
+	if (ret)
+		goto end;
+
+	if (stats->passes > 1)
+		thinkpad_wmi_learn_order(thinkpad, order, count);
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS && count; i++)
+		swap(thinkpad->settings[i].snapshot, snapshot[i]);
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		if (!values[i])
+			continue;
+		thinkpad_wmi_audit(thinkpad, thinkpad->settings[i].name,
+				   thinkpad->settings[i].value, values[i]);
+		thinkpad_wmi_set_value(thinkpad, i, values[i]);
+	}
+	stats->changed = count;
+
+end:
+	stats->result = ret;
+	mutex_unlock(&thinkpad->lock);
+	mutex_unlock(&thinkpad->rescan_lock);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		kfree(values[i]);
+		kfree(snapshot[i]);
+	}
+	kfree(values);
+	kfree(snapshot);
+	kfree(order);
+	return ret;
+}
+
+/*
+ * Replace the snapshot with the current value of every setting. Values are
+ * read and copied one setting at a time, like in thinkpad_wmi_fetch_unknown().
+ * On error, the previous snapshot is kept as a whole.
+ */
+static int thinkpad_wmi_take_snapshot(struct thinkpad_wmi *thinkpad)
+{
+	char **snapshot;
+	int i, ret = 0;
+
+	snapshot = kcalloc(LENOVO_MAX_SETTINGS, sizeof(*snapshot), GFP_KERNEL);
+	if (!snapshot)
+		return -ENOMEM;
+
+	mutex_lock(&thinkpad->rescan_lock);
+	for (i = 0; !ret && i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		mutex_lock(&thinkpad->lock);
+		if (setting->name && (!setting->value || setting->suspect))
+			ret = thinkpad_wmi_fetch_value(thinkpad, i,
+						       THINKPAD_WMI_PRIO_BULK);
+		if (!ret && setting->name) {
+			snapshot[i] = kstrdup(setting->value, GFP_KERNEL);
+			if (!snapshot[i])
+				ret = -ENOMEM;
+		}
+		mutex_unlock(&thinkpad->lock);
+		cond_resched();
+	}
+
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; !ret && i < LENOVO_MAX_SETTINGS; i++)
+		swap(thinkpad->settings[i].snapshot, snapshot[i]);
+	mutex_unlock(&thinkpad->lock);
+	mutex_unlock(&thinkpad->rescan_lock);
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++)
+		kfree(snapshot[i]);
+	kfree(snapshot);
+	return ret;
+}
+
+/*
+ * Apply the settings of the snapshot that differ from their known value, in
+ * a single transaction. This takes a snapshot of the rolled back settings,
+ * so rolling back again redoes the change.
+ */
+static int thinkpad_wmi_rollback(struct thinkpad_wmi *thinkpad)
+{
+	size_t size = 1, len = 0;
+	char *data;
+	int i, ret;
+
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (setting->snapshot)
+			size += strlen(setting->name) +
+				strlen(setting->snapshot) + 2;
+	}
+
+	data = kmalloc(size, GFP_KERNEL);
+	if (!data) {
+		mutex_unlock(&thinkpad->lock);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (!setting->snapshot ||
+		    (setting->value && !strcmp(setting->value,
+					       setting->snapshot)))
+			continue;
+		len += sprintf(data + len, "%s=%s\n", setting->name,
+			       setting->snapshot);
+	}
+	data[len] = '\0';
+	mutex_unlock(&thinkpad->lock);
+
+	/* The values are compared again under lock by the apply */
+	ret = len ? thinkpad_wmi_apply_profile(thinkpad, data) : 0;
+	kfree(data);
+	return ret;
+}
+
+/* Hibernation */
+
+/* Read back a suspect setting, called with lock held */
+static void thinkpad_wmi_revalidate(struct thinkpad_wmi *thinkpad, int item)
+{
+	struct thinkpad_wmi_setting *setting = &thinkpad->settings[item];
+	char *settings = NULL, *choices = NULL, *value = NULL;
+
+	if (!setting->suspect)
+		return;
+
+	if (!thinkpad_wmi_bios_setting(thinkpad, THINKPAD_WMI_PRIO_BULK, item,
+				       &settings) && settings)
+		value = strchr(settings, ',');
+	/* Unknown rather than wrong, it is read again on first use */
+	thinkpad_wmi_set_value(thinkpad, item, value ? value + 1 : NULL);
+
+	if (setting->choices &&
+	    !thinkpad_wmi_get_bios_selections(thinkpad, THINKPAD_WMI_PRIO_BULK,
+					      setting->name, &choices) &&
+	    choices && strcmp(choices, setting->choices))
+		thinkpad->suspect_changed++;
+	swap(setting->choices, choices);
+
+	setting->suspect = false;
+	thinkpad_wmi_update_table(thinkpad, item);
+	kfree(settings);
+	kfree(choices);
+}
+
+/*
+ * Read back the settings marked suspect on restore, with lock dropped after
+ * each one so that users are not locked out for long. If some changed, generation is
+ * bumped and a change uevent is sent.
+ */
+static void thinkpad_wmi_revalidate_work(struct work_struct *work)
+{
+	struct thinkpad_wmi *thinkpad = container_of(work, struct thinkpad_wmi,
+						     revalidate_work);
+	struct kobject *kobj = &thinkpad->wmi_device->dev.kobj;
+	char *envp[3] = { NULL };
+	unsigned int generation;
+	int i, changed;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		mutex_lock(&thinkpad->lock);
+		thinkpad_wmi_revalidate(thinkpad, i);
+		mutex_unlock(&thinkpad->lock);
+		cond_resched();
+	}
+
+	mutex_lock(&thinkpad->lock);
+	changed = thinkpad->suspect_changed;
+	thinkpad->suspect_changed = 0;
+	if (changed)
+		thinkpad->generation++;
+	generation = thinkpad->generation;
+	mutex_unlock(&thinkpad->lock);
+
+	if (!changed)
+		return;
+
+	pr_info("%d settings changed while hibernated\n", changed);
+	sysfs_notify(kobj, NULL, "generation");
+	envp[0] = kasprintf(GFP_KERNEL, "SETTINGS_CHANGED=%d", changed);
+	envp[1] = kasprintf(GFP_KERNEL, "GENERATION=%u", generation);
+	if (envp[0] && envp[1])
+		kobject_uevent_env(kobj, KOBJ_CHANGE, envp);
+	for (i = 0; i < ARRAY_SIZE(envp); i++)
+		kfree(envp[i]);
+}
+
+/* sysfs */
+
+#define to_ext_attr(x) container_of(x, struct dev_ext_attribute, attr)
+
+static ssize_t show_setting(struct device *dev,
+			    struct device_attribute *attr,
+			    char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	struct dev_ext_attribute *ea = to_ext_attr(attr);
+	int item = (uintptr_t)ea->var;
+	struct thinkpad_wmi_setting *setting = &thinkpad->settings[item];
+	char *name = setting->name;
+	char *settings = NULL, *choices = NULL, *value;
+	ssize_t count = 0;
+	int ret;
+
+	mutex_lock(&thinkpad->lock);
+	if (thinkpad->value_cache && setting->value && !setting->suspect &&
+	    (setting->choices || !thinkpad->can_get_bios_selections)) {
+		count = sprintf(buf, "%s\n", setting->value);
+		if (setting->choices)
+			count += sprintf(buf + count, "%s\n", setting->choices);
+		goto error;
+	}
+
+	/* Over the limit, answer with what is known, in the same format */
+	if (!thinkpad_wmi_may_read(thinkpad)) {
+		if (!setting->value || setting->suspect ||
+		    (!setting->choices && thinkpad->can_get_bios_selections)) {
+			ret = -EAGAIN;
+			goto error;
+		}
+		count = sprintf(buf, "%s\n", setting->value);
+		if (setting->choices)
+			count += sprintf(buf + count, "%s\n", setting->choices);
+		goto error;
+	}
+
+	ret = thinkpad_wmi_bios_setting(thinkpad, THINKPAD_WMI_PRIO_INTERACTIVE,
+					item, &settings);
+	if (ret)
+		goto error;
+	if (!settings) {
+		ret = -EIO;
+		goto error;
+	}
+
+	if (thinkpad->can_get_bios_selections) {
+		ret = thinkpad_wmi_get_bios_selections(thinkpad,
+						THINKPAD_WMI_PRIO_INTERACTIVE,
+						name, &choices);
+		if (ret)
+			goto error;
+		if (!choices || !*choices) {
+			ret = -EIO;
+			goto error;
+		}
+	}
+
+	value = strchr(settings, ',');
+	if (!value)
+		goto error;
+	value++;
+
+	count = sprintf(buf, "%s\n", value);
+	if (choices)
+		count += sprintf(buf + count, "%s\n", choices);
+
+	/* Keep what we just read for the next cached read */
+	swap(setting->choices, choices);
+	thinkpad_wmi_set_value(thinkpad, item, value);
+	if (setting->suspect) {
+		setting->suspect = false;
+		thinkpad_wmi_update_table(thinkpad, item);
+	}
+
+error:
+	mutex_unlock(&thinkpad->lock);
+	kfree(settings);
+	kfree(choices);
+	return ret ? ret : count;
+}
+
+static ssize_t store_setting(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	struct dev_ext_attribute *ea = to_ext_attr(attr);
+	int item = (uintptr_t)ea->var;
+	char *buffer, *value;
+	int ret;
+
+	buffer = kstrndup(buf, count, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+	value = strim(buffer);
+
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_commit_setting(thinkpad, item, value);
+	mutex_unlock(&thinkpad->lock);
+	kfree(buffer);
+	return ret ? ret : count;
+}
+
+
+static int thinkpad_wmi_create_setting_file(struct thinkpad_wmi *thinkpad,
+					    int item)
+{
+	struct dev_ext_attribute *deveattr = &thinkpad->devattrs[item];
+	struct device_attribute *devattr = &deveattr->attr;
+	int ret;
+
+	sysfs_attr_init(&devattr->attr);
+	devattr->attr.name = thinkpad->settings[item].name;
+	devattr->attr.mode = S_IRUGO | S_IWUSR;
+	devattr->show = show_setting;
+	devattr->store = store_setting;
+	deveattr->var = (void *)(uintptr_t)item;
+	ret = device_create_file(&thinkpad->wmi_device->dev, devattr);
+	if (ret) {
+		/* Name is used to check is file has been created. */
+		devattr->attr.name = NULL;
+	}
+	return ret;
+}
+
+/* Waits for pending show/store, so never call it with the lock held. */
+static void thinkpad_wmi_remove_setting_file(struct thinkpad_wmi *thinkpad,
+					     int item)
+{
+	struct device_attribute *devattr = &thinkpad->devattrs[item].attr;
+
+	if (!devattr->attr.name)
+		return;
+	device_remove_file(&thinkpad->wmi_device->dev, devattr);
+	devattr->attr.name = NULL;
+}
+
+
+/* Password related sysfs methods */
+static ssize_t show_auth(struct thinkpad_wmi *thinkpad, char *buf,
+			 const char *data, size_t size)
+{
+	ssize_t ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	mutex_lock(&thinkpad->lock);
+	ret = sprintf(buf, "%s\n", data ? : "(nil)");
+	mutex_unlock(&thinkpad->lock);
+	return ret;
+}
+
+/* Create the auth string from password chunks */
+static void update_auth_string(struct thinkpad_wmi *thinkpad)
+{
+	if (!*thinkpad->password) {
+		/* No password at all */
+		thinkpad->auth_string[0] = '\0';
+		return;
+	}
+	strcpy(thinkpad->auth_string, thinkpad->password);
+
+	if (*thinkpad->password_encoding) {
+		strcat(thinkpad->auth_string, ",");
+		strcat(thinkpad->auth_string, thinkpad->password_encoding);
+	}
+
+	if (*thinkpad->password_kbdlang) {
+		strcat(thinkpad->auth_string, ",");
+		strcat(thinkpad->auth_string, thinkpad->password_kbdlang);
+	}
+}
+
+static ssize_t store_auth(struct thinkpad_wmi *thinkpad,
+			  const char *buf, size_t count,
+			  char *dst, size_t size)
+{
+	ssize_t ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (count > size - 1)
+		return -EINVAL;
+
+	mutex_lock(&thinkpad->lock);
+	/* dst may be being reused, NUL-terminate */
+	ret = strscpy(dst, buf, size);
+	if (ret >= 0) {
+		if (count)
+			strim(dst);
+		update_auth_string(thinkpad);
+		ret = count;
+	}
+	mutex_unlock(&thinkpad->lock);
+
+	return ret;
+}
+
+#define THINKPAD_WMI_CREATE_AUTH_ATTR(_name, _uname, _mode)		\
+	static ssize_t show_##_name(struct device *dev,			\
+				    struct device_attribute *attr,	\
+				    char *buf)				\
+	{								\
+		struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);	\
+									\
+		return show_auth(thinkpad, buf,				\
+				 thinkpad->_name,			\
+				 sizeof(thinkpad->_name));		\
+	}								\
+	static ssize_t store_##_name(struct device *dev,		\
+				     struct device_attribute *attr,	\
+				     const char *buf, size_t count)	\
+	{								\
+		struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);	\
+									\
+		return store_auth(thinkpad, buf, count,			\
+				  thinkpad->_name,			\
+				  sizeof(thinkpad->_name));		\
+	}								\
+	static struct device_attribute dev_attr_##_name = {		\
+		.attr = {						\
+			.name = _uname,					\
+			.mode = _mode },				\
+		.show   = show_##_name,					\
+		.store  = store_##_name,				\
+	}
+
+THINKPAD_WMI_CREATE_AUTH_ATTR(password, "password", S_IRUSR|S_IWUSR);
+THINKPAD_WMI_CREATE_AUTH_ATTR(password_encoding, "password_encoding",
+			      S_IRUSR|S_IWUSR);
+THINKPAD_WMI_CREATE_AUTH_ATTR(password_kbdlang, "password_kbd_lang",
+			      S_IRUSR|S_IWUSR);
+THINKPAD_WMI_CREATE_AUTH_ATTR(password_type, "password_type", S_IRUSR|S_IWUSR);
+
+static ssize_t show_password_settings(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	struct thinkpad_wmi_pcfg pcfg;
+	ssize_t ret;
+
+	ret = thinkpad_wmi_password_settings(thinkpad, &pcfg);
+	if (ret)
+		return ret;
+
+	mutex_lock(&thinkpad->lock);
+	thinkpad->pcfg = pcfg;
+	thinkpad->pcfg_valid = true;
+	mutex_unlock(&thinkpad->lock);
+
+	ret += sprintf(buf, "password_mode:       %#x\n", pcfg.password_mode);
+	ret += sprintf(buf + ret, "password_state:      %#x\n",
+		       pcfg.password_state);
+	ret += sprintf(buf + ret, "min_length:          %d\n", pcfg.min_length);
+	ret += sprintf(buf + ret, "max_length:          %d\n", pcfg.max_length);
+	ret += sprintf(buf + ret, "supported_encodings: %#x\n",
+		       pcfg.supported_encodings);
+	ret += sprintf(buf + ret, "supported_keyboard:  %#x\n",
+		       pcfg.supported_keyboard);
+	return ret;
+}
+
+static DEVICE_ATTR(password_settings, S_IRUSR, show_password_settings, NULL);
+
+static const char * const thinkpad_wmi_kbdlangs[] = { "us", "fr", "gr" };
+
+/*
+ * Reject the password changes the password settings rule out, before they
+ * reach the firmware and count towards the invalid password limit. Called
+ * with lock held, len is the length of the new password.
+ */
+static int thinkpad_wmi_check_password(struct thinkpad_wmi *thinkpad,
+				       size_t len)
+{
+	struct thinkpad_wmi_pcfg *pcfg = &thinkpad->pcfg;
+	const char *type = thinkpad->password_type;
+	u32 bit = 0;
+	int lang;
+
+	if (!*type)
+		return -EINVAL;
+	if (!thinkpad->can_get_password_settings)
+		return 0;
+	if (!thinkpad->pcfg_valid) {
+		if (thinkpad_wmi_password_settings(thinkpad, pcfg))
+			return 0; /* Let the firmware decide */
+		thinkpad->pcfg_valid = true;
+	}
+
+	if (!strcmp(type, "pop"))
+		bit = THINKPAD_WMI_PASSWORD_POP;
+	else if (!strcmp(type, "pap"))
+		bit = THINKPAD_WMI_PASSWORD_PAP;
+	else if (!strncmp(type, "uhdp", 4) || !strncmp(type, "mhdp", 4))
+		bit = THINKPAD_WMI_PASSWORD_HDD;
+
+	if (bit) {
+		/* Passwords can only be updated or cleared, not set */
+		if (!(pcfg->password_state & bit))
+			return -ENOENT;
+		/* ... and only with the current one */
+		if (!*thinkpad->password)
+			return -EACCES;
+	}
+
+	if (len && pcfg->min_length && len < pcfg->min_length)
+		return -EINVAL;
+	if (pcfg->max_length && len > pcfg->max_length)
+		return -E2BIG;
+
+	if ((!strcmp(thinkpad->password_encoding, "ascii") &&
+	     !(pcfg->supported_encodings & THINKPAD_WMI_ENCODING_ASCII)) ||
+	    (!strcmp(thinkpad->password_encoding, "scancode") &&
+	     !(pcfg->supported_encodings & THINKPAD_WMI_ENCODING_SCANCODE)))
+		return -EOPNOTSUPP;
+
+	lang = match_string(thinkpad_wmi_kbdlangs,
+			    ARRAY_SIZE(thinkpad_wmi_kbdlangs),
+			    thinkpad->password_kbdlang);
+	if (lang >= 0 && !(pcfg->supported_keyboard & BIT(lang)))
+		return -EOPNOTSUPP;
+
+	return 0;
+}
+
+static ssize_t store_password_change(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	size_t buffer_size, len = count;
+	char *buffer;
+	ssize_t ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	/* Trailing whitespace is not part of the new password */
+	while (len && isspace(buf[len - 1]))
+		len--;
+
+	/* Format: 'PasswordType,CurrentPw,NewPw,Encoding,KbdLang;' */
+
+	/* auth_string is the size of CurrentPassword,Encoding,KbdLang */
+	buffer_size = (sizeof(thinkpad->password_type) + 1 + count + 1 +
+		       sizeof(thinkpad->auth_string) + 2);
+	buffer = kmalloc(buffer_size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_check_password(thinkpad, len);
+	if (ret)
+		goto end;
+
+	strcpy(buffer, thinkpad->password_type);
+
+	if (*thinkpad->password) {
+		strcat(buffer, ",");
+		strcat(buffer, thinkpad->password);
+	}
+	strcat(buffer, ",");
+	strncat(buffer, buf, count);
+	if (count)
+		strim(buffer);
+
+	if (*thinkpad->password_encoding) {
+		strcat(buffer, ",");
+		strcat(buffer, thinkpad->password_encoding);
+	}
+	if (*thinkpad->password_kbdlang) {
+		strcat(buffer, ",");
+		strcat(buffer, thinkpad->password_kbdlang);
+	}
+	strcat(buffer, ";");
+
+	ret = thinkpad_wmi_set_bios_password(thinkpad, buffer);
+	/* Only the type is logged, never the passwords */
+	if (!ret) {
+		thinkpad_wmi_audit(thinkpad, "(password)", "",
+				   thinkpad->password_type);
+		/* The installed passwords may have changed */
+		thinkpad->pcfg_valid = false;
+	}
+end:
+	mutex_unlock(&thinkpad->lock);
+	kfree(buffer);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static struct device_attribute dev_attr_password_change = {
+	.attr = {
+		.name = "password_change",
+		.mode = S_IWUSR },
+	.store  = store_password_change,
+};
+
+
+static ssize_t store_load_default(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	int ret;
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_load_default(thinkpad, thinkpad->auth_string);
+	if (!ret) {
+		thinkpad_wmi_audit(thinkpad, "(load_default)", "", "");
+		thinkpad_wmi_invalidate_values(thinkpad);
+	}
+	mutex_unlock(&thinkpad->lock);
+	if (ret)
+		return ret;
+	return count;
+
+}
+
+static DEVICE_ATTR(load_default_settings, S_IWUSR, NULL, store_load_default);
+
+/* Desired state and drift */
+static ssize_t show_baseline(struct device *dev,
+			     struct device_attribute *attr,
+			     char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	ssize_t count = 0;
+	int i;
+
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (!setting->baseline)
+			continue;
+		count += scnprintf(buf + count, PAGE_SIZE - count, "%s=%s\n",
+				   setting->name, setting->baseline);
+	}
+	mutex_unlock(&thinkpad->lock);
+
+	return count;
+}
+
+static ssize_t store_baseline(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	char **baseline, *data;
+	ssize_t ret;
+	int i;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	baseline = kcalloc(LENOVO_MAX_SETTINGS, sizeof(*baseline), GFP_KERNEL);
+	data = kstrndup(buf, count, GFP_KERNEL);
+	if (!baseline || !data) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_parse_profile(thinkpad, data, baseline);
+	if (!ret) {
+		/* Replace the whole baseline, an empty write clears it */
+		for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+			swap(thinkpad->settings[i].baseline, baseline[i]);
+			thinkpad_wmi_check_drift(thinkpad, i);
+		}
+		ret = count;
+	}
+	mutex_unlock(&thinkpad->lock);
+
+end:
+	for (i = 0; baseline && i < LENOVO_MAX_SETTINGS; i++)
+		kfree(baseline[i]);
+	kfree(baseline);
+	kfree(data);
+	return ret;
+}
+
+static DEVICE_ATTR(baseline, S_IRUSR | S_IWUSR, show_baseline, store_baseline);
+
+static ssize_t show_drift(struct device *dev,
+			  struct device_attribute *attr,
+			  char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	ssize_t count = 0;
+	int i;
+
+	thinkpad_wmi_fetch_unknown(thinkpad, true);
+
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (!setting->drift)
+			continue;
+		/* Drifted before, and could not be read again */
+		if (!setting->value)
+			count += scnprintf(buf + count, PAGE_SIZE - count,
+					   "%s (unknown, expected %s)\n",
+					   setting->name, setting->baseline);
+		else
+			count += scnprintf(buf + count, PAGE_SIZE - count,
+					   "%s=%s (expected %s)\n",
+					   setting->name, setting->value,
+					   setting->baseline);
+	}
+	mutex_unlock(&thinkpad->lock);
+
+	return count;
+}
+
+static DEVICE_ATTR(drift, S_IRUSR, show_drift, NULL);
+
+static ssize_t show_drift_count(struct device *dev,
+				struct device_attribute *attr,
+				char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	int count;
+
+	thinkpad_wmi_fetch_unknown(thinkpad, true);
+
+	mutex_lock(&thinkpad->lock);
+	count = thinkpad->drift_count;
+	mutex_unlock(&thinkpad->lock);
+
+	return sprintf(buf, "%d\n", count);
+}
+
+static DEVICE_ATTR(drift_count, S_IRUGO, show_drift_count, NULL);
+
+static ssize_t show_config_digest(struct device *dev,
+				  struct device_attribute *attr,
+				  char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	int ret;
+
+	if (!thinkpad->config_digest_valid)
+		thinkpad_wmi_fetch_unknown(thinkpad, false);
+
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_update_digest(thinkpad);
+	if (!ret)
+		ret = sprintf(buf, "%*phN\n", SHA256_DIGEST_SIZE,
+			      thinkpad->config_digest);
+	mutex_unlock(&thinkpad->lock);
+
+	return ret;
+}
+
+static DEVICE_ATTR(config_digest, S_IRUGO, show_config_digest, NULL);
+
+static ssize_t show_profile_status(struct device *dev,
+				   struct device_attribute *attr,
+				   char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", *thinkpad->profile_status ?
+		       thinkpad->profile_status : "none");
+}
+
+static DEVICE_ATTR(profile_status, S_IRUGO, show_profile_status, NULL);
+
+/*
+ * Discover the settings again, e.g. after a BIOS update, and only add or
+ * remove the files of the settings that changed. A setting that moved to
+ * another instance is removed then added back.
+ */
+static ssize_t store_rescan(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	struct thinkpad_wmi_setting *found;
+	char *added, *removed, *envp[5] = { NULL };
+	size_t added_len = 0, removed_len = 0;
+	int i, nr_added = 0, nr_removed = 0;
+	ssize_t ret = count;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	found = kcalloc(LENOVO_MAX_SETTINGS, sizeof(*found), GFP_KERNEL);
+	added = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	removed = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!found || !added || !removed) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	mutex_lock(&thinkpad->rescan_lock);
+	thinkpad_wmi_discover(thinkpad, found);
+
+	/* Remove the files first, nobody can use the old name after that. */
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		const char *name = thinkpad->settings[i].name;
+
+		if (!name || (found[i].name && !strcmp(name, found[i].name)))
+			continue;
+		thinkpad_wmi_remove_setting_file(thinkpad, i);
+		removed_len += scnprintf(removed + removed_len,
+					 PAGE_SIZE - removed_len, "%s%s",
+					 nr_removed ? "," : "", name);
+		nr_removed++;
+	}
+
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (setting->name && found[i].name &&
+		    !strcmp(setting->name, found[i].name)) {
+			/* Unchanged, only refresh the value */
+			thinkpad_wmi_set_value(thinkpad, i, found[i].value);
+			kfree(setting->choices);
+			setting->choices = NULL;
+			kfree(found[i].name);
+			kfree(found[i].value);
+			continue;
+		}
+		/* Empty before and after */
+		if (!setting->name && !found[i].name)
+			continue;
+
+		if (setting->drift)
+			thinkpad->drift_count--;
+		/* The learned order may refer to this instance */
+		thinkpad->apply_order_len = 0;
+		kfree(setting->name);
+		kfree(setting->value);
+		kfree(setting->choices);
+		kfree(setting->baseline);
+		kfree(setting->snapshot);
+		memset(setting, 0, sizeof(*setting));
+
+		setting->name = found[i].name;
+		setting->value = found[i].value;
+	}
+	thinkpad_wmi_hash_settings(thinkpad);
+	mutex_unlock(&thinkpad->lock);
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		const char *name = thinkpad->settings[i].name;
+
+		if (!name || thinkpad->devattrs[i].attr.attr.name)
+			continue;
+		if (thinkpad_wmi_create_setting_file(thinkpad, i))
+			pr_warn("Failed to create file for %s\n", name);
+		added_len += scnprintf(added + added_len,
+				       PAGE_SIZE - added_len, "%s%s",
+				       nr_added ? "," : "", name);
+		nr_added++;
+	}
+	mutex_unlock(&thinkpad->rescan_lock);
+
+	pr_info("Rescan: %d settings added, %d removed\n", nr_added, nr_removed);
+	if (nr_added || nr_removed) {
+		envp[0] = kasprintf(GFP_KERNEL, "SETTINGS_ADDED=%d", nr_added);
+		envp[1] = kasprintf(GFP_KERNEL, "SETTINGS_REMOVED=%d",
+				    nr_removed);
+		envp[2] = kasprintf(GFP_KERNEL, "ADDED=%.512s", added);
+		envp[3] = kasprintf(GFP_KERNEL, "REMOVED=%.512s", removed);
+		if (envp[0] && envp[1] && envp[2] && envp[3])
+			kobject_uevent_env(&dev->kobj, KOBJ_CHANGE, envp);
+		for (i = 0; i < ARRAY_SIZE(envp); i++)
+			kfree(envp[i]);
+	}
+
+end:
+	kfree(found);
+	kfree(added);
+	kfree(removed);
+	return ret;
+}
+
+static DEVICE_ATTR(rescan, S_IWUSR, NULL, store_rescan);
+
+static ssize_t show_generation(struct device *dev,
+			       struct device_attribute *attr,
+			       char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	unsigned int generation;
+
+	mutex_lock(&thinkpad->lock);
+	generation = thinkpad->generation;
+	mutex_unlock(&thinkpad->lock);
+
+	return sprintf(buf, "%u\n", generation);
+}
+
+static DEVICE_ATTR(generation, S_IRUGO, show_generation, NULL);
+
+static ssize_t show_value_cache(struct device *dev,
+				struct device_attribute *attr,
+				char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", thinkpad->value_cache);
+}
+
+static ssize_t store_value_cache(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&thinkpad->lock);
+	thinkpad->value_cache = enable;
+	mutex_unlock(&thinkpad->lock);
+	return count;
+}
+
+static DEVICE_ATTR(value_cache, S_IRUGO | S_IWUSR, show_value_cache,
+		   store_value_cache);
+
+static ssize_t show_read_limit_interval_ms(struct device *dev,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n",
+		       jiffies_to_msecs(thinkpad->read_limit.interval));
+}
+
+static ssize_t store_read_limit_interval_ms(struct device *dev,
+					    struct device_attribute *attr,
+					    const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	unsigned int interval;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &interval);
+	if (ret)
+		return ret;
+
+	mutex_lock(&thinkpad->lock);
+	thinkpad->read_limit.interval = msecs_to_jiffies(interval);
+	mutex_unlock(&thinkpad->lock);
+	return count;
+}
+
+static DEVICE_ATTR(read_limit_interval_ms, S_IRUGO | S_IWUSR,
+		   show_read_limit_interval_ms, store_read_limit_interval_ms);
+
+static ssize_t show_read_limit_burst(struct device *dev,
+				     struct device_attribute *attr,
+				     char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", thinkpad->read_limit.burst);
+}
+
+static ssize_t store_read_limit_burst(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	int burst, ret;
+
+	ret = kstrtoint(buf, 0, &burst);
+	if (ret)
+		return ret;
+	if (burst < 0)
+		return -EINVAL;
+
+	mutex_lock(&thinkpad->lock);
+	thinkpad->read_limit.burst = burst;
+	mutex_unlock(&thinkpad->lock);
+	return count;
+}
+
+static DEVICE_ATTR(read_limit_burst, S_IRUGO | S_IWUSR,
+		   show_read_limit_burst, store_read_limit_burst);
+
+static ssize_t show_read_throttled(struct device *dev,
+				   struct device_attribute *attr,
+				   char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	unsigned long throttled;
+
+	mutex_lock(&thinkpad->lock);
+	throttled = thinkpad->read_throttled;
+	mutex_unlock(&thinkpad->lock);
+
+	return sprintf(buf, "%lu\n", throttled);
+}
+
+static DEVICE_ATTR(read_throttled, S_IRUGO, show_read_throttled, NULL);
+
+static ssize_t show_housekeeping_cpus(struct device *dev,
+				      struct device_attribute *attr,
+				      char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	mutex_lock(&thinkpad->call_lock);
+	ret = sprintf(buf, "%*pbl\n", cpumask_pr_args(thinkpad->housekeeping));
+	mutex_unlock(&thinkpad->call_lock);
+	return ret;
+}
+
+static ssize_t store_housekeeping_cpus(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	cpumask_var_t mask;
+	int ret;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	ret = cpulist_parse(buf, mask);
+	if (!ret) {
+		mutex_lock(&thinkpad->call_lock);
+		cpumask_copy(thinkpad->housekeeping, mask);
+		mutex_unlock(&thinkpad->call_lock);
+	}
+	free_cpumask_var(mask);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(housekeeping_cpus, S_IRUGO | S_IWUSR,
+		   show_housekeeping_cpus, store_housekeeping_cpus);
+
+static ssize_t store_cache_flush(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+
+	mutex_lock(&thinkpad->lock);
+	thinkpad_wmi_flush_cache(thinkpad);
+	mutex_unlock(&thinkpad->lock);
+	return count;
+}
+
+static DEVICE_ATTR(cache_flush, S_IWUSR, NULL, store_cache_flush);
+
+/* Bulk access */
+
+/* 'Item=Value' lines of the settings with a known value, with lock held */
+static char *thinkpad_wmi_settings_listing(struct thinkpad_wmi *thinkpad,
+					   size_t *len)
+{
+	size_t size = 0;
+	char *data;
+	int i;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (setting->name && setting->value)
+			size += strlen(setting->name) +
+				strlen(setting->value) + 2;
+	}
+
+	data = kmalloc(size + 1, GFP_KERNEL);
+	if (!data)
+		return NULL;
+
+	*len = 0;
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		if (setting->name && setting->value)
+			*len += sprintf(data + *len, "%s=%s\n", setting->name,
+					setting->value);
+	}
+	return data;
+}
+
+/*
+ * The listing is built when read from offset 0, after one sweep of the
+ * unknown values, and the next offsets are read from that same listing.
+ */
+static ssize_t read_settings(struct file *filp, struct kobject *kobj,
+			     THINKPAD_WMI_BIN_ATTR_CONST struct bin_attribute *attr,
+			     char *buf, loff_t off, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(kobj_to_dev(kobj));
+	ssize_t ret;
+	size_t len;
+	char *data;
+
+	if (off == 0)
+		thinkpad_wmi_fetch_unknown(thinkpad, false);
+
+	mutex_lock(&thinkpad->lock);
+	if (off == 0 || !thinkpad->listing) {
+		data = thinkpad_wmi_settings_listing(thinkpad, &len);
+		if (!data) {
+			mutex_unlock(&thinkpad->lock);
+			return -ENOMEM;
+		}
+		kfree(thinkpad->listing);
+		thinkpad->listing = data;
+		thinkpad->listing_len = len;
+	}
+	ret = memory_read_from_buffer(buf, count, &off, thinkpad->listing,
+				      thinkpad->listing_len);
+	mutex_unlock(&thinkpad->lock);
+	return ret;
+}
+
+static struct bin_attribute bin_attr_settings = {
+	.attr = {
+		.name = "settings",
+		.mode = S_IRUGO },
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)) && \
+    (LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0))
+	.read_new = read_settings,
+#else
+	.read = read_settings,
+#endif
+};
+
+/*
+ * The settings table, to be mapped read-only. Reading it returns a
+ * consistent copy.
+ */
+static ssize_t read_table(struct file *filp, struct kobject *kobj,
+			  THINKPAD_WMI_BIN_ATTR_CONST struct bin_attribute *attr,
+			  char *buf, loff_t off, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(kobj_to_dev(kobj));
+	ssize_t ret;
+
+	mutex_lock(&thinkpad->lock);
+	ret = memory_read_from_buffer(buf, count, &off, thinkpad->table,
+				      sizeof(*thinkpad->table));
+	mutex_unlock(&thinkpad->lock);
+	return ret;
+}
+
+static int mmap_table(struct file *filp, struct kobject *kobj,
+		      THINKPAD_WMI_BIN_ATTR_CONST struct bin_attribute *attr,
+		      struct vm_area_struct *vma)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, thinkpad->table, vma->vm_pgoff);
+}
+
+static struct bin_attribute bin_attr_table = {
+	.attr = {
+		.name = "table",
+		.mode = S_IRUGO },
+	.size = sizeof(struct thinkpad_wmi_table),
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)) && \
+    (LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0))
+	.read_new = read_table,
+#else
+	.read = read_table,
+#endif
+	.mmap = mmap_table,
+};
+
+/* Capabilities found at probe, as saved in the layout */
+static u32 thinkpad_wmi_caps(struct thinkpad_wmi *thinkpad)
+{
+	return thinkpad->can_set_bios_settings |
+	       thinkpad->can_discard_bios_settings << 1 |
+	       thinkpad->can_load_default_settings << 2 |
+	       thinkpad->can_get_bios_selections << 3 |
+	       thinkpad->can_set_bios_password << 4 |
+	       thinkpad->can_get_password_settings << 5;
+}
+
+/*
+ * Layout of the settings, to be loaded back at the next probe instead of
+ * querying every instance. It only holds for this BIOS version.
+ */
+static ssize_t read_layout(struct file *filp, struct kobject *kobj,
+			   THINKPAD_WMI_BIN_ATTR_CONST struct bin_attribute *attr,
+			   char *buf, loff_t off, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(kobj_to_dev(kobj));
+	const char *version = dmi_get_system_info(DMI_BIOS_VERSION);
+	const char *date = dmi_get_system_info(DMI_BIOS_DATE);
+	size_t size, len;
+	ssize_t ret;
+	char *data;
+	int i;
+
+	if (!version || !date)
+		return -ENODEV;
+
+	mutex_lock(&thinkpad->rescan_lock);
+	mutex_lock(&thinkpad->lock);
+	size = strlen(version) + strlen(date) + 64;
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		if (thinkpad->settings[i].name)
+			size += strlen(thinkpad->settings[i].name) + 6;
+	}
 
-	ret = thinkpad_wmi_set_bios_settings(buffer);
-	if (ret)
+	data = kmalloc(size, GFP_KERNEL);
+	if (!data) {
+		ret = -ENOMEM;
 		goto end;
+	}
 
-	ret = thinkpad_wmi_save_bios_settings(thinkpad->auth_string);
-	if (ret) {
-		/* Try to discard the settings if we failed to apply them. */
-		thinkpad_wmi_discard_bios_settings(thinkpad->auth_string);
-		goto end;
+	len = sprintf(data, "bios_version=%s\nbios_date=%s\ncaps=%x\nend=%d\n",
+		      version, date, thinkpad_wmi_caps(thinkpad),
+		      thinkpad->settings_end);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		if (thinkpad->settings[i].name)
+			len += sprintf(data + len, "%d=%s\n", i,
+				       thinkpad->settings[i].name);
 	}
-	ret = count;
 
+	ret = memory_read_from_buffer(buf, count, &off, data, len);
+	kfree(data);
 end:
-	kfree(buffer);
+	mutex_unlock(&thinkpad->lock);
+	mutex_unlock(&thinkpad->rescan_lock);
 	return ret;
 }
 
+static struct bin_attribute bin_attr_layout = {
+	.attr = {
+		.name = "layout",
+		.mode = S_IRUGO },
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)) && \
+    (LINUX_VERSION_CODE < KERNEL_VERSION(6, 16, 0))
+	.read_new = read_layout,
+#else
+	.read = read_layout,
+#endif
+};
+
+static ssize_t show_apply(struct device *dev,
+			  struct device_attribute *attr,
+			  char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	struct thinkpad_wmi_apply_stats stats;
+
+	mutex_lock(&thinkpad->lock);
+	stats = thinkpad->apply_stats;
+	mutex_unlock(&thinkpad->lock);
+
+	return sprintf(buf,
+		       "result:    %d\n"
+		       "changed:   %d\n"
+		       "unchanged: %d\n"
+		       "passes:    %d\n"
+		       "parse_us:  %llu\n"
+		       "stage_us:  %llu\n"
+		       "commit_us: %llu\n",
+		       stats.result, stats.changed, stats.unchanged,
+		       stats.passes,
+		       stats.parse_ns / NSEC_PER_USEC,
+		       stats.stage_ns / NSEC_PER_USEC,
+		       stats.commit_ns / NSEC_PER_USEC);
+}
 
-/* Password related sysfs methods */
-static ssize_t show_auth(struct thinkpad_wmi *thinkpad, char *buf,
-			 const char *data, size_t size)
+static ssize_t store_apply(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
 {
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	char *data;
+	int ret;
+
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 
-	return sprintf(buf, "%s\n", data ? : "(nil)");
+	data = kstrndup(buf, count, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	ret = thinkpad_wmi_apply_profile(thinkpad, data);
+	kfree(data);
+	return ret ? ret : count;
 }
 
-/* Create the auth string from password chunks */
-static void update_auth_string(struct thinkpad_wmi *thinkpad)
+static DEVICE_ATTR(apply, S_IRUSR | S_IWUSR, show_apply, store_apply);
+
+static ssize_t show_snapshot(struct device *dev,
+			     struct device_attribute *attr,
+			     char *buf)
 {
-	if (!*thinkpad->password) {
-		/* No password at all */
-		thinkpad->auth_string[0] = '\0';
-		return;
-	}
-	strcpy(thinkpad->auth_string, thinkpad->password);
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	ssize_t count = 0;
+	int i;
 
-	if (*thinkpad->password_encoding) {
-		strcat(thinkpad->auth_string, ",");
-		strcat(thinkpad->auth_string, thinkpad->password_encoding);
-	}
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
 
-	if (*thinkpad->password_kbdlang) {
-		strcat(thinkpad->auth_string, ",");
-		strcat(thinkpad->auth_string, thinkpad->password_kbdlang);
+		if (!setting->snapshot)
+			continue;
+		count += scnprintf(buf + count, PAGE_SIZE - count, "%s=%s\n",
+				   setting->name, setting->snapshot);
 	}
+	mutex_unlock(&thinkpad->lock);
+
+	return count;
 }
 
-static ssize_t store_auth(struct thinkpad_wmi *thinkpad,
-			  const char *buf, size_t count,
-			  char *dst, size_t size)
+static ssize_t store_snapshot(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
 {
-	ssize_t ret;
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	int ret;
 
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 
-	if (count > size - 1)
-		return -EINVAL;
+	ret = thinkpad_wmi_take_snapshot(thinkpad);
+	return ret ? ret : count;
+}
 
-	/* dst may be being reused, NUL-terminate */
-	ret = strscpy(dst, buf, size);
-	if (ret < 0)
-		return ret;
-	if (count)
-		strim(dst);
+static DEVICE_ATTR(snapshot, S_IRUSR | S_IWUSR, show_snapshot, store_snapshot);
 
-	update_auth_string(thinkpad);
+static ssize_t store_rollback(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	int ret;
 
-	return count;
-}
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
 
-#define THINKPAD_WMI_CREATE_AUTH_ATTR(_name, _uname, _mode)		\
-	static ssize_t show_##_name(struct device *dev,			\
-				    struct device_attribute *attr,	\
-				    char *buf)				\
-	{								\
-		struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);	\
-									\
-		return show_auth(thinkpad, buf,				\
-				 thinkpad->_name,			\
-				 sizeof(thinkpad->_name));		\
-	}								\
-	static ssize_t store_##_name(struct device *dev,		\
-				     struct device_attribute *attr,	\
-				     const char *buf, size_t count)	\
-	{								\
-		struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);	\
-									\
-		return store_auth(thinkpad, buf, count,			\
-				  thinkpad->_name,			\
-				  sizeof(thinkpad->_name));		\
-	}								\
-	static struct device_attribute dev_attr_##_name = {		\
-		.attr = {						\
-			.name = _uname,					\
-			.mode = _mode },				\
-		.show   = show_##_name,					\
-		.store  = store_##_name,				\
-	}
+	ret = thinkpad_wmi_rollback(thinkpad);
+	return ret ? ret : count;
+}
 
-THINKPAD_WMI_CREATE_AUTH_ATTR(password, "password", S_IRUSR|S_IWUSR);
-THINKPAD_WMI_CREATE_AUTH_ATTR(password_encoding, "password_encoding",
-			      S_IRUSR|S_IWUSR);
-THINKPAD_WMI_CREATE_AUTH_ATTR(password_kbdlang, "password_kbd_lang",
-			      S_IRUSR|S_IWUSR);
-THINKPAD_WMI_CREATE_AUTH_ATTR(password_type, "password_type", S_IRUSR|S_IWUSR);
+static DEVICE_ATTR(rollback, S_IWUSR, NULL, store_rollback);
 
-static ssize_t show_password_settings(struct device *dev,
-				      struct device_attribute *attr,
-				      char *buf)
+static ssize_t show_apply_order(struct device *dev,
+				struct device_attribute *attr,
+				char *buf)
 {
-	struct thinkpad_wmi_pcfg pcfg;
-	ssize_t ret;
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	ssize_t count = 0;
+	int i;
 
-	ret = thinkpad_wmi_password_settings(&pcfg);
-	if (ret)
-		return ret;
-	ret += sprintf(buf, "password_mode:       %#x\n", pcfg.password_mode);
-	ret += sprintf(buf + ret, "password_state:      %#x\n",
-		       pcfg.password_state);
-	ret += sprintf(buf + ret, "min_length:          %d\n", pcfg.min_length);
-	ret += sprintf(buf + ret, "max_length:          %d\n", pcfg.max_length);
-	ret += sprintf(buf + ret, "supported_encodings: %#x\n",
-		       pcfg.supported_encodings);
-	ret += sprintf(buf + ret, "supported_keyboard:  %#x\n",
-		       pcfg.supported_keyboard);
-	return ret;
-}
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; i < thinkpad->apply_order_len; i++)
+		count += scnprintf(buf + count, PAGE_SIZE - count, "%s\n",
+			thinkpad->settings[thinkpad->apply_order[i]].name);
+	mutex_unlock(&thinkpad->lock);
 
-static DEVICE_ATTR(password_settings, S_IRUSR, show_password_settings, NULL);
+	return count;
+}
 
-static ssize_t store_password_change(struct device *dev,
-				     struct device_attribute *attr,
-				     const char *buf, size_t count)
+static ssize_t store_apply_order(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
 	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
-	size_t buffer_size;
-	char *buffer;
-	ssize_t ret;
+	char *data;
+	int ret;
 
 	if (!capable(CAP_SYS_ADMIN))
 		return -EPERM;
 
-	/* Format: 'PasswordType,CurrentPw,NewPw,Encoding,KbdLang;' */
-
-	/* auth_string is the size of CurrentPassword,Encoding,KbdLang */
-	buffer_size = (sizeof(thinkpad->password_type) + 1 + count + 1 +
-		       sizeof(thinkpad->auth_string) + 2);
-	buffer = kmalloc(buffer_size, GFP_KERNEL);
-	if (!buffer)
+	data = kstrndup(buf, count, GFP_KERNEL);
+	if (!data)
 		return -ENOMEM;
 
-	strcpy(buffer, thinkpad->password_type);
-
-	if (*thinkpad->password) {
-		strcat(buffer, ",");
-		strcat(buffer, thinkpad->password);
-	}
-	strcat(buffer, ",");
-	strncat(buffer, buf, count);
-	if (count)
-		strim(buffer);
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_parse_order(thinkpad, data);
+	mutex_unlock(&thinkpad->lock);
+	kfree(data);
+	return ret ? ret : count;
+}
 
-	if (*thinkpad->password_encoding) {
-		strcat(buffer, ",");
-		strcat(buffer, thinkpad->password_encoding);
-	}
-	if (*thinkpad->password_kbdlang) {
-		strcat(buffer, ",");
-		strcat(buffer, thinkpad->password_kbdlang);
-	}
-	strcat(buffer, ";");
+static DEVICE_ATTR(apply_order, S_IRUGO | S_IWUSR, show_apply_order,
+		   store_apply_order);
 
-	ret = thinkpad_wmi_set_bios_password(buffer);
-	if (ret)
-		return ret;
+static ssize_t show_audit_log(struct device *dev,
+			      struct device_attribute *attr,
+			      char *buf)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
 
-	return count;
+	return thinkpad_wmi_audit_read(thinkpad, buf);
 }
 
-static struct device_attribute dev_attr_password_change = {
-	.attr = {
-		.name = "password_change",
-		.mode = S_IWUSR },
-	.store  = store_password_change,
-};
-
+static DEVICE_ATTR(audit_log, S_IRUSR, show_audit_log, NULL);
 
-static ssize_t store_load_default(struct device *dev,
+static ssize_t show_audit_dropped(struct device *dev,
 				  struct device_attribute *attr,
-				  const char *buf, size_t count)
+				  char *buf)
 {
-	int ret;
 	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	u64 dropped;
 
-	ret = thinkpad_wmi_load_default(thinkpad->auth_string);
-	if (ret)
-		return ret;
-	return count;
+	mutex_lock(&thinkpad->audit.lock);
+	dropped = thinkpad->audit.dropped;
+	mutex_unlock(&thinkpad->audit.lock);
 
+	return sprintf(buf, "%llu\n", dropped);
 }
 
-static DEVICE_ATTR(load_default_settings, S_IWUSR, NULL, store_load_default);
+static DEVICE_ATTR(audit_dropped, S_IRUSR, show_audit_dropped, NULL);
 
 static struct attribute *platform_attributes[] = {
 	&dev_attr_password_settings.attr,
@@ -778,6 +3517,25 @@ static struct attribute *platform_attributes[] = {
 	&dev_attr_password_type.attr,
 	&dev_attr_password_change.attr,
 	&dev_attr_load_default_settings.attr,
+	&dev_attr_baseline.attr,
+	&dev_attr_drift.attr,
+	&dev_attr_drift_count.attr,
+	&dev_attr_config_digest.attr,
+	&dev_attr_profile_status.attr,
+	&dev_attr_rescan.attr,
+	&dev_attr_generation.attr,
+	&dev_attr_value_cache.attr,
+	&dev_attr_cache_flush.attr,
+	&dev_attr_read_limit_interval_ms.attr,
+	&dev_attr_read_limit_burst.attr,
+	&dev_attr_read_throttled.attr,
+	&dev_attr_housekeeping_cpus.attr,
+	&dev_attr_apply.attr,
+	&dev_attr_apply_order.attr,
+	&dev_attr_snapshot.attr,
+	&dev_attr_rollback.attr,
+	&dev_attr_audit_log.attr,
+	&dev_attr_audit_dropped.attr,
 	NULL
 };
 
@@ -801,17 +3559,16 @@ static void thinkpad_wmi_sysfs_exit(struct wmi_device *wdev)
 	int i;
 
 	sysfs_remove_group(&wdev->dev.kobj, &platform_attribute_group);
+	sysfs_remove_bin_file(&wdev->dev.kobj, &bin_attr_settings);
+	sysfs_remove_bin_file(&wdev->dev.kobj, &bin_attr_layout);
+	if (thinkpad->table)
+		sysfs_remove_bin_file(&wdev->dev.kobj, &bin_attr_table);
 
 	if (!thinkpad->devattrs)
 		return;
 
-	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
-		struct dev_ext_attribute *deveattr = &thinkpad->devattrs[i];
-		struct device_attribute *devattr = &deveattr->attr;
-
-		if (devattr->attr.name)
-			device_remove_file(&wdev->dev, devattr);
-	}
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++)
+		thinkpad_wmi_remove_setting_file(thinkpad, i);
 	kfree(thinkpad->devattrs);
 	thinkpad->devattrs = NULL;
 }
@@ -828,23 +3585,26 @@ static int thinkpad_wmi_sysfs_init(struct wmi_device *wdev)
 	thinkpad->devattrs = devattrs;
 
 	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
-		struct dev_ext_attribute *deveattr = &devattrs[i];
-		struct device_attribute *devattr = &deveattr->attr;
-		if(!thinkpad->settings[i]) {
+		if(!thinkpad->settings[i].name) {
 			continue;
 		}
-		sysfs_attr_init(&devattr->attr);
-		devattr->attr.name = thinkpad->settings[i];
-		devattr->attr.mode = S_IRUGO | S_IWUSR;
-		devattr->show = show_setting;
-		devattr->store = store_setting;
-		deveattr->var = (void *)(uintptr_t)i;
-		ret = device_create_file(&wdev->dev, devattr);
-		if (ret) {
-			/* Name is used to check is file has been created. */
-			devattr->attr.name = NULL;
+		ret = thinkpad_wmi_create_setting_file(thinkpad, i);
+		if (ret)
+			return ret;
+	}
+
+	ret = sysfs_create_bin_file(&wdev->dev.kobj, &bin_attr_settings);
+	if (ret)
+		return ret;
+
+	ret = sysfs_create_bin_file(&wdev->dev.kobj, &bin_attr_layout);
+	if (ret)
+		return ret;
+
+	if (thinkpad->table) {
+		ret = sysfs_create_bin_file(&wdev->dev.kobj, &bin_attr_table);
+		if (ret)
 			return ret;
-		}
 	}
 
 	return sysfs_create_group(&wdev->dev.kobj, &platform_attribute_group);
@@ -870,8 +3630,8 @@ static ssize_t dbgfs_write_argument(struct file *file,
 				    size_t count, loff_t *pos)
 {
 	struct thinkpad_wmi *thinkpad = file->f_path.dentry->d_inode->i_private;
-	char *kernbuf = thinkpad->debug.argument;
-	size_t size = sizeof(thinkpad->debug.argument);
+	char *kernbuf = thinkpad->debug.args.argument;
+	size_t size = sizeof(thinkpad->debug.args.argument);
 
 	if (count > PAGE_SIZE - 1)
 		return -EINVAL;
@@ -879,12 +3639,18 @@ static ssize_t dbgfs_write_argument(struct file *file,
 	if (count > size - 1)
 		return -EINVAL;
 
-	if (copy_from_user(kernbuf, userbuf, count))
+	mutex_lock(&thinkpad->lock);
+	if (copy_from_user(kernbuf, userbuf, count)) {
+		/* Don't leave a partial argument behind */
+		kernbuf[0] = 0;
+		mutex_unlock(&thinkpad->lock);
 		return -EFAULT;
+	}
 
 	kernbuf[count] = 0;
 
 	strim(kernbuf);
+	mutex_unlock(&thinkpad->lock);
 
 	return count;
 }
@@ -893,7 +3659,9 @@ static int dbgfs_show_argument(struct seq_file *m, void *v)
 {
 	struct thinkpad_wmi *thinkpad = m->private;
 
-	seq_printf(m, "%s\n", thinkpad->debug.argument);
+	mutex_lock(&thinkpad->lock);
+	seq_printf(m, "%s\n", thinkpad->debug.args.argument);
+	mutex_unlock(&thinkpad->lock);
 	return 0;
 }
 
@@ -920,12 +3688,13 @@ struct thinkpad_wmi_debugfs_node {
 };
 
 static void show_bios_setting_line(struct thinkpad_wmi *thinkpad,
-				   struct seq_file *m, int i, bool list_valid)
+				   struct seq_file *m, int i,
+				   enum thinkpad_wmi_prio prio)
 {
 	int ret;
 	char *settings = NULL, *choices = NULL, *p;
 
-	ret = thinkpad_wmi_bios_setting(i, &settings);
+	ret = thinkpad_wmi_bios_setting(thinkpad, prio, i, &settings);
 	if (ret || !settings)
 		return;
 
@@ -941,7 +3710,8 @@ static void show_bios_setting_line(struct thinkpad_wmi *thinkpad,
 	if (p)
 		*p = '\0';
 
-	ret = thinkpad_wmi_get_bios_selections(settings, &choices);
+	ret = thinkpad_wmi_get_bios_selections(thinkpad, prio, settings,
+					       &choices);
 	if (ret || !choices || !*choices)
 		goto line_feed;
 
@@ -954,12 +3724,13 @@ line_feed:
 }
 
 static void show_platform_setting_line(struct thinkpad_wmi *thinkpad,
-				   struct seq_file *m, int i, bool list_valid)
+				   struct seq_file *m, int i,
+				   enum thinkpad_wmi_prio prio)
 {
 	int ret;
 	char *settings = NULL, *p;
 
-	ret = thinkpad_wmi_platform_setting(i, &settings);
+	ret = thinkpad_wmi_platform_setting(thinkpad, prio, i, &settings);
 	if (ret || !settings)
 		return;
 
@@ -975,42 +3746,52 @@ static void show_platform_setting_line(struct thinkpad_wmi *thinkpad,
 
 static int dbgfs_bios_settings(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
 	int i;
 
 	for (i = 0; i < LENOVO_MAX_SETTINGS; i++)
-		show_bios_setting_line(thinkpad, m, i, true);
+		show_bios_setting_line(thinkpad, m, i, THINKPAD_WMI_PRIO_BULK);
 
 	return 0;
 }
 
 static int dbgfs_platform_settings(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
 	int i;
 
 	for (i = 0; i < LENOVO_MAX_SETTINGS; i++)
-		show_platform_setting_line(thinkpad, m, i, true);
+		show_platform_setting_line(thinkpad, m, i,
+					   THINKPAD_WMI_PRIO_BULK);
 
 	return 0;
 }
 
 static int dbgfs_bios_setting(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
 
-	show_bios_setting_line(m->private, m, thinkpad->debug.instance, false);
+	show_bios_setting_line(thinkpad, m, args->instance,
+			       THINKPAD_WMI_PRIO_INTERACTIVE);
 	return 0;
 }
 
 static int dbgfs_list_valid_choices(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
 	char *choices = NULL;
 	int ret;
 
-	ret = thinkpad_wmi_get_bios_selections(thinkpad->debug.argument,
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_get_bios_selections(thinkpad,
+					       THINKPAD_WMI_PRIO_INTERACTIVE,
+					       args->argument,
 					       &choices);
+	mutex_unlock(&thinkpad->lock);
 
 	if (ret || !choices || !*choices) {
 		kfree(choices);
@@ -1022,54 +3803,183 @@ static int dbgfs_list_valid_choices(struct seq_file *m, void *data)
 	return 0;
 }
 
+/* Show the value of the setting named by the argument */
+static int dbgfs_get_setting(struct seq_file *m, void *data)
+{
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	int item, ret = 0;
+
+	mutex_lock(&thinkpad->lock);
+	item = thinkpad_wmi_find_setting(thinkpad, args->argument);
+	if (item < 0) {
+		ret = item;
+		goto end;
+	}
+
+	if (!thinkpad->settings[item].value)
+		ret = thinkpad_wmi_fetch_value(thinkpad, item,
+					       THINKPAD_WMI_PRIO_INTERACTIVE);
+	if (!ret)
+		seq_printf(m, "%s=%s\n", thinkpad->settings[item].name,
+			   thinkpad->settings[item].value);
+end:
+	mutex_unlock(&thinkpad->lock);
+	return ret;
+}
+
+/* Set and save 'Item,Value' from the argument, with the sysfs password */
+static int dbgfs_set_setting(struct seq_file *m, void *data)
+{
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	char *name, *value;
+	int item, ret;
+
+	mutex_lock(&thinkpad->lock);
+	name = kstrdup(args->argument, GFP_KERNEL);
+	if (!name) {
+		ret = -ENOMEM;
+		goto end;
+	}
+
+	value = strchr(name, ',');
+	if (!value) {
+		ret = -EINVAL;
+		goto end;
+	}
+	*value++ = '\0';
+
+	item = thinkpad_wmi_find_setting(thinkpad, strim(name));
+	if (item < 0) {
+		ret = item;
+		goto end;
+	}
+	ret = thinkpad_wmi_commit_setting(thinkpad, item, strim(value));
+end:
+	mutex_unlock(&thinkpad->lock);
+	kfree(name);
+	return ret;
+}
+
+/* Audit 'Item,Value' of the argument, the rest may hold the password. */
+static void dbgfs_audit_set(struct thinkpad_wmi *thinkpad,
+			    const char *argument)
+{
+	char *item, *value, *p;
+	int i;
+
+	item = kstrdup(argument, GFP_KERNEL);
+	if (!item)
+		return;
+
+	value = strchr(item, ',');
+	if (value) {
+		*value++ = '\0';
+		p = strpbrk(value, ",;");
+		if (p)
+			*p = '\0';
+	}
+
+	i = thinkpad_wmi_find_setting(thinkpad, item);
+	thinkpad_wmi_audit(thinkpad, item,
+			   i < 0 ? NULL : thinkpad->settings[i].value, value);
+	kfree(item);
+}
+
 static int dbgfs_set_bios_settings(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	int ret;
 
-	return thinkpad_wmi_set_bios_settings(thinkpad->debug.argument);
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_set_bios_settings(thinkpad,
+					     args->argument);
+	if (!ret)
+		dbgfs_audit_set(thinkpad, args->argument);
+	/* Raw calls may change any setting, forget what we know about them. */
+	thinkpad_wmi_invalidate_values(thinkpad);
+	mutex_unlock(&thinkpad->lock);
+	return ret;
 }
 
 static int dbgfs_set_platform_settings(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	int ret;
 
-	return thinkpad_wmi_set_platform_settings(thinkpad->debug.argument);
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_set_platform_settings(thinkpad,
+						 args->argument);
+	mutex_unlock(&thinkpad->lock);
+	return ret;
 }
 
 static int dbgfs_save_bios_settings(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	int ret;
 
-	return thinkpad_wmi_save_bios_settings(thinkpad->debug.argument);
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_save_bios_settings(thinkpad,
+					      args->argument);
+	if (!ret)
+		thinkpad_wmi_audit(thinkpad, "(save)", "", "");
+	thinkpad_wmi_invalidate_values(thinkpad);
+	mutex_unlock(&thinkpad->lock);
+	return ret;
 }
 
 static int dbgfs_discard_bios_settings(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	int ret;
 
-	return thinkpad_wmi_discard_bios_settings(thinkpad->debug.argument);
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_discard_bios_settings(thinkpad,
+						 args->argument);
+	mutex_unlock(&thinkpad->lock);
+	return ret;
 }
 
 static int dbgfs_load_default(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	int ret;
 
-	return thinkpad_wmi_load_default(thinkpad->debug.argument);
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_load_default(thinkpad, args->argument);
+	thinkpad_wmi_invalidate_values(thinkpad);
+	mutex_unlock(&thinkpad->lock);
+	return ret;
 }
 
 static int dbgfs_set_bios_password(struct seq_file *m, void *data)
 {
-	struct thinkpad_wmi *thinkpad = m->private;
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	int ret;
 
-	return thinkpad_wmi_set_bios_password(thinkpad->debug.argument);
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_set_bios_password(thinkpad,
+					     args->argument);
+	mutex_unlock(&thinkpad->lock);
+	return ret;
 }
 
 static int dbgfs_bios_password_settings(struct seq_file *m, void *data)
 {
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
 	struct thinkpad_wmi_pcfg pcfg;
 	int ret;
 
-	ret = thinkpad_wmi_password_settings(&pcfg);
+	ret = thinkpad_wmi_password_settings(thinkpad, &pcfg);
 	if (ret)
 		return ret;
 	seq_printf(m, "password_mode:       %#x\n", pcfg.password_mode);
@@ -1081,6 +3991,80 @@ static int dbgfs_bios_password_settings(struct seq_file *m, void *data)
 	return 0;
 }
 
+static int dbgfs_call_stats(struct seq_file *m, void *data)
+{
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	struct thinkpad_wmi_call_stats stats[THINKPAD_WMI_OP_MAX];
+	int i;
+
+	spin_lock(&thinkpad->call_stats_lock);
+	memcpy(stats, thinkpad->call_stats, sizeof(stats));
+	spin_unlock(&thinkpad->call_stats_lock);
+
+	seq_printf(m, "%-24s %10s %8s %12s %10s %10s\n", "operation", "calls",
+		   "errors", "total_us", "avg_us", "max_us");
+	for (i = 0; i < THINKPAD_WMI_OP_MAX; i++) {
+		if (!stats[i].calls)
+			continue;
+		seq_printf(m, "%-24s %10llu %8llu %12llu %10llu %10llu\n",
+			   thinkpad_wmi_op_names[i], stats[i].calls,
+			   stats[i].errors, stats[i].total_ns / NSEC_PER_USEC,
+			   div64_u64(stats[i].total_ns, stats[i].calls) /
+			   NSEC_PER_USEC,
+			   stats[i].max_ns / NSEC_PER_USEC);
+	}
+	return 0;
+}
+
+static int dbgfs_smi_stats(struct seq_file *m, void *data)
+{
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	struct thinkpad_wmi_call_stats stats[THINKPAD_WMI_OP_MAX];
+	unsigned int tsc_mhz = tsc_khz / 1000;
+	int i;
+
+	spin_lock(&thinkpad->call_stats_lock);
+	memcpy(stats, thinkpad->call_stats, sizeof(stats));
+	spin_unlock(&thinkpad->call_stats_lock);
+
+	seq_printf(m, "%-24s %10s %10s %10s %14s %12s\n", "operation", "calls",
+		   "smis", "unsampled", "cycles", "tsc_us");
+	for (i = 0; i < THINKPAD_WMI_OP_MAX; i++) {
+		if (!stats[i].calls)
+			continue;
+		seq_printf(m, "%-24s %10llu %10llu %10llu %14llu %12llu\n",
+			   thinkpad_wmi_op_names[i], stats[i].calls,
+			   stats[i].smis, stats[i].unsampled, stats[i].cycles,
+			   tsc_mhz ? div_u64(stats[i].cycles, tsc_mhz) : 0);
+	}
+	return 0;
+}
+
+static int dbgfs_discovery_latency(struct seq_file *m, void *data)
+{
+	struct thinkpad_wmi_debug_args *args = m->private;
+	struct thinkpad_wmi *thinkpad = args->thinkpad;
+	u64 total = 0;
+	int i;
+
+	mutex_lock(&thinkpad->rescan_lock);
+	seq_printf(m, "%-8s %10s %s\n", "instance", "us", "setting");
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		u64 ns = thinkpad->discovery_ns[i];
+
+		if (!ns)
+			continue;
+		seq_printf(m, "%-8d %10llu %s\n", i, div_u64(ns, NSEC_PER_USEC),
+			   thinkpad->settings[i].name ? : "-");
+		total += ns;
+	}
+	seq_printf(m, "%-8s %10llu\n", "total", div_u64(total, NSEC_PER_USEC));
+	mutex_unlock(&thinkpad->rescan_lock);
+	return 0;
+}
+
 static struct thinkpad_wmi_debugfs_node thinkpad_wmi_debug_files[] = {
 	{ NULL, "bios_settings", dbgfs_bios_settings },
 	{ NULL, "bios_setting", dbgfs_bios_setting },
@@ -1093,13 +4077,18 @@ static struct thinkpad_wmi_debugfs_node thinkpad_wmi_debug_files[] = {
 	{ NULL, "bios_password_settings", dbgfs_bios_password_settings },
 	{ NULL, "platform_settings", dbgfs_platform_settings },
 	{ NULL, "set_platform_settings", dbgfs_set_platform_settings },
+	{ NULL, "call_stats", dbgfs_call_stats },
+	{ NULL, "get_setting", dbgfs_get_setting },
+	{ NULL, "set_setting", dbgfs_set_setting },
+	{ NULL, "discovery_latency", dbgfs_discovery_latency },
+	{ NULL, "smi_stats", dbgfs_smi_stats },
 };
 
 static int thinkpad_wmi_debugfs_open(struct inode *inode, struct file *file)
 {
 	struct thinkpad_wmi_debugfs_node *node = inode->i_private;
 
-	return single_open(file, node->show, node->thinkpad);
+	return single_open(file, node->show, &node->thinkpad->debug.args);
 }
 
 static const struct file_operations thinkpad_wmi_debugfs_io_ops = {
@@ -1110,6 +4099,179 @@ static const struct file_operations thinkpad_wmi_debugfs_io_ops = {
 	.release = single_release,
 };
 
+/*
+ * A session has its own argument and instance. Writing 'op argument' runs
+ * op, one of the files above, and returns its status; reading the session
+ * then gives the output of that run.
+ */
+struct thinkpad_wmi_session {
+	/* Protects args and result */
+	struct mutex lock;
+	struct thinkpad_wmi_debug_args args;
+	char *result;
+	size_t result_len;
+};
+
+static int dbgfs_session_show(struct seq_file *m, void *data)
+{
+	struct thinkpad_wmi_session *session =
+		container_of(m->private, struct thinkpad_wmi_session, args);
+
+	mutex_lock(&session->lock);
+	if (session->result)
+		seq_write(m, session->result, session->result_len);
+	mutex_unlock(&session->lock);
+	return 0;
+}
+
+/*
+ * Run node into the session's result, with the session lock held. Like
+ * seq_read(), a show that does not fit is run again with a larger buffer:
+ * only the listings outgrow a page, and they do not change the firmware.
+ */
+static int thinkpad_wmi_session_run(struct thinkpad_wmi_session *session,
+				    struct thinkpad_wmi_debugfs_node *node)
+{
+	struct seq_file m = { .private = &session->args };
+	size_t size = PAGE_SIZE;
+	int ret;
+
+	for (;;) {
+		m.buf = kvmalloc(size, GFP_KERNEL);
+		if (!m.buf)
+			return -ENOMEM;
+		m.size = size;
+		m.count = 0;
+		ret = node->show(&m, NULL);
+		if (ret || !seq_has_overflowed(&m))
+			break;
+		kvfree(m.buf);
+		size <<= 1;
+	}
+	if (ret) {
+		kvfree(m.buf);
+		return ret;
+	}
+
+	kvfree(session->result);
+	session->result = m.buf;
+	session->result_len = m.count;
+	return 0;
+}
+
+static int dbgfs_session_open(struct inode *inode, struct file *file)
+{
+	struct thinkpad_wmi_session *session;
+	int ret;
+
+	session = kzalloc(sizeof(*session), GFP_KERNEL);
+	if (!session)
+		return -ENOMEM;
+
+	mutex_init(&session->lock);
+	session->args.thinkpad = inode->i_private;
+	ret = single_open(file, dbgfs_session_show, &session->args);
+	if (ret)
+		kfree(session);
+	return ret;
+}
+
+static ssize_t dbgfs_session_write(struct file *file,
+				   const char __user *userbuf,
+				   size_t count, loff_t *pos)
+{
+	struct seq_file *m = file->private_data;
+	struct thinkpad_wmi_session *session =
+		container_of(m->private, struct thinkpad_wmi_session, args);
+	struct thinkpad_wmi_debugfs_node *node = NULL;
+	char *buf, *op, *argument;
+	u8 instance = 0;
+	int i, ret = 0;
+
+	if (count > PAGE_SIZE - 1)
+		return -EINVAL;
+
+	buf = memdup_user_nul(userbuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	argument = strim(buf);
+	op = strsep(&argument, " ");
+	for (i = 0; i < ARRAY_SIZE(thinkpad_wmi_debug_files); i++) {
+		/* Only the files that were created */
+		if (thinkpad_wmi_debug_files[i].thinkpad &&
+		    !strcmp(thinkpad_wmi_debug_files[i].name, op))
+			node = &thinkpad_wmi_debug_files[i];
+	}
+	argument = argument ? skip_spaces(argument) : "";
+	if (!node || strlen(argument) >= sizeof(session->args.argument)) {
+		ret = -EINVAL;
+		goto end;
+	}
+	/* The argument is the instance for bios_setting */
+	if (node->show == dbgfs_bios_setting &&
+	    kstrtou8(argument, 0, &instance)) {
+		ret = -EINVAL;
+		goto end;
+	}
+
+	mutex_lock(&session->lock);
+	strscpy(session->args.argument, argument,
+		sizeof(session->args.argument));
+	session->args.instance = instance;
+	ret = thinkpad_wmi_session_run(session, node);
+	mutex_unlock(&session->lock);
+
+	/* Reading starts over, on the output of this run */
+	*pos = 0;
+end:
+	kfree(buf);
+	return ret ? ret : count;
+}
+
+static int dbgfs_session_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+	struct thinkpad_wmi_session *session =
+		container_of(m->private, struct thinkpad_wmi_session, args);
+
+	single_release(inode, file);
+	kvfree(session->result);
+	kfree(session);
+	return 0;
+}
+
+static const struct file_operations thinkpad_wmi_debugfs_session_fops = {
+	.owner		= THIS_MODULE,
+	.open		= dbgfs_session_open,
+	.read		= seq_read,
+	.write		= dbgfs_session_write,
+	.llseek		= seq_lseek,
+	.release	= dbgfs_session_release,
+};
+
+/* Drain the trace of the calls, see thinkpad_wmi_trace_call() */
+static ssize_t dbgfs_trace_read(struct file *file, char __user *userbuf,
+				size_t count, loff_t *pos)
+{
+	struct thinkpad_wmi *thinkpad = file->private_data;
+	unsigned int copied;
+	int ret;
+
+	mutex_lock(&thinkpad->trace_lock);
+	ret = kfifo_to_user(&thinkpad->trace, userbuf, count, &copied);
+	mutex_unlock(&thinkpad->trace_lock);
+
+	return ret ? ret : copied;
+}
+
+static const struct file_operations thinkpad_wmi_debugfs_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= dbgfs_trace_read,
+	.llseek		= noop_llseek,
+};
+
 static void thinkpad_wmi_debugfs_exit(struct thinkpad_wmi *thinkpad)
 {
 	debugfs_remove_recursive(thinkpad->debug.root);
@@ -1120,7 +4282,7 @@ static int thinkpad_wmi_debugfs_init(struct thinkpad_wmi *thinkpad)
 	struct dentry *dent;
 	int i;
 
-	thinkpad->debug.instances_count = LENOVO_MAX_SETTINGS;
+	thinkpad->debug.args.thinkpad = thinkpad;
 
 	thinkpad->debug.root = debugfs_create_dir(THINKPAD_WMI_FILE, NULL);
 	if (!thinkpad->debug.root) {
@@ -1136,7 +4298,7 @@ static int thinkpad_wmi_debugfs_init(struct thinkpad_wmi *thinkpad)
 
 	debugfs_create_u8("instance", S_IRUGO | S_IWUSR,
 				 thinkpad->debug.root,
-				 &thinkpad->debug.instance);
+				 &thinkpad->debug.args.instance);
 
 	dent = debugfs_create_u32("instances_count", S_IRUGO,
 				 thinkpad->debug.root,
@@ -1179,6 +4341,24 @@ static int thinkpad_wmi_debugfs_init(struct thinkpad_wmi *thinkpad)
 		}
 	}
 
+	dent = debugfs_create_file("session", S_IRUGO | S_IWUSR,
+				   thinkpad->debug.root, thinkpad,
+				   &thinkpad_wmi_debugfs_session_fops);
+	if (!dent)
+		goto error_debugfs;
+
+	if (kfifo_initialized(&thinkpad->trace)) {
+		debugfs_create_bool("record", S_IRUSR | S_IWUSR,
+				    thinkpad->debug.root, &thinkpad->record);
+		debugfs_create_u64("trace_dropped", S_IRUSR,
+				   thinkpad->debug.root,
+				   &thinkpad->trace_dropped);
+		dent = debugfs_create_file("trace", S_IRUSR,
+					   thinkpad->debug.root, thinkpad,
+					   &thinkpad_wmi_debugfs_trace_fops);
+		if (!dent)
+			goto error_debugfs;
+	}
 
 	return 0;
 
@@ -1188,63 +4368,326 @@ error_debugfs:
 }
 
 /* Base driver */
-static void thinkpad_wmi_analyze(struct thinkpad_wmi *thinkpad)
+/*
+ * Firmware file named by a module parameter, or thinkpad-wmi/<product>
+ * followed by suffix.
+ */
+static char *thinkpad_wmi_firmware_name(const char *param, const char *suffix)
 {
-	acpi_status status;
-	int i, settings_count = 0;
+	const char *product;
+	char *name;
 
-	/* Try to find the number of valid settings on this machine. */
-	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
-		char *item = NULL;
-		int spleng = 0;
-		int num = 0;
-		char *p;
+	if (param && *param)
+		return kstrdup(param, GFP_KERNEL);
 
-		status = thinkpad_wmi_bios_setting(i, &item);
-		if (ACPI_FAILURE(status))
-			break;
-		if (!item )
-			break;
-		if (!*item)
+	product = dmi_get_system_info(DMI_PRODUCT_NAME);
+	if (!product || !*product)
+		return NULL;
+	name = kasprintf(GFP_KERNEL, THINKPAD_WMI_FILE "/%s%s", product, suffix);
+	if (name)
+		strreplace(name + strlen(THINKPAD_WMI_FILE "/"), '/', '_');
+	return name;
+}
+
+/* Parse a layout exported by read_layout() into thinkpad->settings */
+static int thinkpad_wmi_parse_layout(struct thinkpad_wmi *thinkpad, char *data)
+{
+	const char *version = dmi_get_system_info(DMI_BIOS_VERSION);
+	const char *date = dmi_get_system_info(DMI_BIOS_DATE);
+	bool version_ok = false, date_ok = false, caps_ok = false;
+	int i, end = -1, count = 0;
+	char *line, *value;
+	u32 caps;
+
+	while ((line = strsep(&data, "\n"))) {
+		value = strchr(line, '=');
+		if (!value)
 			continue;
+		*value++ = '\0';
+
+		if (!strcmp(line, "bios_version")) {
+			version_ok = version && !strcmp(value, version);
+		} else if (!strcmp(line, "bios_date")) {
+			date_ok = date && !strcmp(value, date);
+		} else if (!strcmp(line, "caps")) {
+			caps_ok = !kstrtou32(value, 16, &caps) &&
+				  caps == thinkpad_wmi_caps(thinkpad);
+		} else if (!strcmp(line, "end")) {
+			if (kstrtoint(value, 10, &end))
+				return -EINVAL;
+		} else if (!kstrtoint(line, 10, &i) && i >= 0 &&
+			   i < LENOVO_MAX_SETTINGS && *value &&
+			   !thinkpad->settings[i].name) {
+			thinkpad->settings[i].name = kstrdup(value, GFP_KERNEL);
+			if (!thinkpad->settings[i].name)
+				return -ENOMEM;
+			count++;
+		} else {
+			return -EINVAL;
+		}
+	}
 
-		/* It is not allowed to have '/' for file name. Convert it into '\'. */
-		spleng = strlen(item);
-		for (num = 0; num < spleng; num++) {
-			if (item[num] == '/') {
-				item[num] = '\\';
-			}
+	if (!version_ok || !date_ok || !caps_ok)
+		return -ESTALE;
+	if (end < 0 || end > LENOVO_MAX_SETTINGS || !count)
+		return -EINVAL;
+	for (i = end; i < LENOVO_MAX_SETTINGS; i++) {
+		if (thinkpad->settings[i].name)
+			return -EINVAL;
+	}
+
+	thinkpad->settings_end = end;
+	thinkpad->debug.instances_count = end;
+	return count;
+}
+
+/* Query a setting from the layout, the name must still match */
+static int thinkpad_wmi_check_layout_item(struct thinkpad_wmi *thinkpad,
+					  int item)
+{
+	char *settings = NULL, *value;
+	int ret;
+
+	ret = thinkpad_wmi_bios_setting(thinkpad, THINKPAD_WMI_PRIO_BULK, item,
+					&settings);
+	if (ret)
+		return ret;
+	if (!settings)
+		return -ESTALE;
+
+	value = strchr(settings, ',');
+	if (value)
+		*value++ = '\0';
+	/* Only the name, as in thinkpad_wmi_discover() */
+	strreplace(settings, '/', '\\');
+
+	if (strcmp(settings, thinkpad->settings[item].name))
+		ret = -ESTALE;
+	else if (value)
+		ret = thinkpad_wmi_set_value(thinkpad, item, value);
+	kfree(settings);
+	return ret;
+}
+
+/*
+ * A few spot checks instead of a full discovery: the first, middle and last
+ * settings must have the same name and the instance past them must be empty.
+ */
+static int thinkpad_wmi_check_layout(struct thinkpad_wmi *thinkpad)
+{
+	int count = 0, n = 0, i, ret;
+	char *settings = NULL;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		if (thinkpad->settings[i].name)
+			count++;
+	}
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		if (!thinkpad->settings[i].name)
+			continue;
+		if (n == 0 || n == count / 2 || n == count - 1) {
+			ret = thinkpad_wmi_check_layout_item(thinkpad, i);
+			if (ret)
+				return ret;
 		}
+		n++;
+	}
 
-		/* Remove the value part */
-		p = strchr(item, ',');
-		if (p)
-			*p = '\0';
-		thinkpad->settings[i] = item; /* Cache setting name */
-		settings_count++;
+	if (thinkpad->settings_end >= LENOVO_MAX_SETTINGS)
+		return 0;
+
+	ret = thinkpad_wmi_bios_setting(thinkpad, THINKPAD_WMI_PRIO_BULK,
+					thinkpad->settings_end, &settings);
+	/* Discovery would have gone further */
+	ret = !ret && settings && *settings ? -ESTALE : 0;
+	kfree(settings);
+	return ret;
+}
+
+static int thinkpad_wmi_load_layout(struct thinkpad_wmi *thinkpad)
+{
+	struct device *dev = &thinkpad->wmi_device->dev;
+	const struct firmware *fw;
+	char *name, *data;
+	int i, ret;
+
+	name = thinkpad_wmi_firmware_name(layout, ".layout");
+	if (!name)
+		return -ENOENT;
+
+	ret = request_firmware_direct(&fw, name, dev);
+	if (ret)
+		goto end;
+
+	data = kmemdup_nul((const char *)fw->data, fw->size, GFP_KERNEL);
+	release_firmware(fw);
+	if (!data) {
+		ret = -ENOMEM;
+		goto end;
 	}
 
-	pr_info("Found %d settings", settings_count);
+	ret = thinkpad_wmi_parse_layout(thinkpad, data);
+	kfree(data);
+	if (ret > 0)
+		ret = thinkpad_wmi_check_layout(thinkpad) ? : ret;
+
+	if (ret > 0) {
+		pr_info("Using layout %s\n", name);
+	} else {
+		pr_info("Ignoring layout %s: %d\n", name, ret);
+		for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+			kfree(thinkpad->settings[i].name);
+			kfree(thinkpad->settings[i].value);
+			thinkpad->settings[i].name = NULL;
+			thinkpad->settings[i].value = NULL;
+		}
+		thinkpad->settings_end = 0;
+		if (!ret)
+			ret = -EINVAL;
+	}
 
-	if (wmi_has_guid(LENOVO_SET_BIOS_SETTINGS_GUID) &&
-	    wmi_has_guid(LENOVO_SAVE_BIOS_SETTINGS_GUID)) {
+end:
+	kfree(name);
+	return ret;
+}
+
+static void thinkpad_wmi_analyze(struct thinkpad_wmi *thinkpad)
+{
+	int settings_count;
+
+	if (thinkpad_wmi_has_guid(thinkpad, LENOVO_SET_BIOS_SETTINGS_GUID) &&
+	    thinkpad_wmi_has_guid(thinkpad, LENOVO_SAVE_BIOS_SETTINGS_GUID)) {
 		thinkpad->can_set_bios_settings = true;
 	}
 
-	if (wmi_has_guid(LENOVO_DISCARD_BIOS_SETTINGS_GUID))
+	if (thinkpad_wmi_has_guid(thinkpad, LENOVO_DISCARD_BIOS_SETTINGS_GUID))
 		thinkpad->can_discard_bios_settings = true;
 
-	if (wmi_has_guid(LENOVO_LOAD_DEFAULT_SETTINGS_GUID))
+	if (thinkpad_wmi_has_guid(thinkpad, LENOVO_LOAD_DEFAULT_SETTINGS_GUID))
 		thinkpad->can_load_default_settings = true;
 
-	if (wmi_has_guid(LENOVO_GET_BIOS_SELECTIONS_GUID))
+	if (thinkpad_wmi_has_guid(thinkpad, LENOVO_GET_BIOS_SELECTIONS_GUID))
 		thinkpad->can_get_bios_selections = true;
 
-	if (wmi_has_guid(LENOVO_SET_BIOS_PASSWORD_GUID))
+	if (thinkpad_wmi_has_guid(thinkpad, LENOVO_SET_BIOS_PASSWORD_GUID))
 		thinkpad->can_set_bios_password = true;
 
-	if (wmi_has_guid(LENOVO_BIOS_PASSWORD_SETTINGS_GUID))
+	if (thinkpad_wmi_has_guid(thinkpad, LENOVO_BIOS_PASSWORD_SETTINGS_GUID))
 		thinkpad->can_get_password_settings = true;
+
+	/* The layout is checked against the capabilities, find them first */
+	settings_count = thinkpad_wmi_load_layout(thinkpad);
+	if (settings_count <= 0)
+		settings_count = thinkpad_wmi_discover(thinkpad,
+						       thinkpad->settings);
+	thinkpad_wmi_hash_settings(thinkpad);
+	pr_info("Found %d settings", settings_count);
+}
+
+/* Load the apply order saved for this model, if any */
+static void thinkpad_wmi_load_order(struct thinkpad_wmi *thinkpad)
+{
+	struct device *dev = &thinkpad->wmi_device->dev;
+	const struct firmware *fw;
+	char *name, *data;
+	int ret;
+
+	name = thinkpad_wmi_firmware_name(NULL, ".order");
+	if (!name)
+		return;
+
+	ret = request_firmware_direct(&fw, name, dev);
+	if (ret)
+		goto end;
+
+	data = kmemdup_nul((const char *)fw->data, fw->size, GFP_KERNEL);
+	release_firmware(fw);
+	if (!data)
+		goto end;
+
+	mutex_lock(&thinkpad->lock);
+	ret = thinkpad_wmi_parse_order(thinkpad, data);
+	mutex_unlock(&thinkpad->lock);
+	kfree(data);
+	if (ret)
+		pr_warn("Ignoring apply order %s: %d\n", name, ret);
+
+end:
+	kfree(name);
+}
+
+/*
+ * Apply the profile shipped as a firmware file, if any. This runs at probe
+ * time, possibly from the initramfs, before any userspace tool could.
+ */
+static void thinkpad_wmi_load_profile(struct thinkpad_wmi *thinkpad)
+{
+	struct device *dev = &thinkpad->wmi_device->dev;
+	const struct firmware *fw;
+	char *name, *data;
+	int ret;
+
+	name = thinkpad_wmi_firmware_name(profile, ".conf");
+	if (!name)
+		return;
+
+	/* No fallback to userspace, it isn't there yet. */
+	ret = request_firmware_direct(&fw, name, dev);
+	if (ret)
+		goto end;
+
+	data = kmemdup_nul((const char *)fw->data, fw->size, GFP_KERNEL);
+	release_firmware(fw);
+
+	if (!data)
+		ret = -ENOMEM;
+	else if (!thinkpad->can_set_bios_settings)
+		ret = -ENODEV;
+	else
+		ret = thinkpad_wmi_apply_profile(thinkpad, data);
+	kfree(data);
+
+	if (ret) {
+		pr_warn("Failed to apply profile %s: %d\n", name, ret);
+		snprintf(thinkpad->profile_status,
+			 sizeof(thinkpad->profile_status),
+			 "%s: error %d", name, ret);
+	} else {
+		pr_info("Applied %d settings from profile %s\n",
+			thinkpad->apply_stats.changed, name);
+		snprintf(thinkpad->profile_status,
+			 sizeof(thinkpad->profile_status),
+			 "%s: applied %d", name, thinkpad->apply_stats.changed);
+	}
+
+end:
+	kfree(name);
+}
+
+/* Free what add() allocated, on its error path and on remove */
+static void thinkpad_wmi_free(struct thinkpad_wmi *thinkpad)
+{
+	int i;
+
+	for (i = 0; i < LENOVO_MAX_SETTINGS; ++i) {
+		struct thinkpad_wmi_setting *setting = &thinkpad->settings[i];
+
+		kfree(setting->name);
+		kfree(setting->value);
+		kfree(setting->choices);
+		kfree(setting->baseline);
+		kfree(setting->snapshot);
+		setting->name = NULL;
+	}
+	kfree(thinkpad->listing);
+
+	thinkpad_wmi_free_replay(thinkpad->replay);
+	kfifo_free(&thinkpad->trace);
+	vfree(thinkpad->table);
+	crypto_free_shash(thinkpad->digest_tfm);
+	kvfree(thinkpad->audit.entries);
+	free_cpumask_var(thinkpad->housekeeping);
+	kvfree(thinkpad);
 }
 
 static int thinkpad_wmi_add(struct wmi_device *wdev)
@@ -1252,14 +4695,68 @@ static int thinkpad_wmi_add(struct wmi_device *wdev)
 	struct thinkpad_wmi *thinkpad;
 	int err;
 
-	thinkpad = kzalloc(sizeof(struct thinkpad_wmi), GFP_KERNEL);
+	/* The settings alone are several pages */
+	thinkpad = kvzalloc(sizeof(struct thinkpad_wmi), GFP_KERNEL);
 	if (!thinkpad)
 		return -ENOMEM;
 
+	if (!zalloc_cpumask_var(&thinkpad->housekeeping, GFP_KERNEL)) {
+		kvfree(thinkpad);
+		return -ENOMEM;
+	}
+	thinkpad->audit.entries = kvcalloc(THINKPAD_WMI_AUDIT_ENTRIES,
+					   sizeof(*thinkpad->audit.entries),
+					   GFP_KERNEL);
+	if (!thinkpad->audit.entries) {
+		thinkpad_wmi_free(thinkpad);
+		return -ENOMEM;
+	}
+	if (housekeeping && cpulist_parse(housekeeping, thinkpad->housekeeping))
+		pr_warn("Invalid housekeeping CPUs: %s\n", housekeeping);
+
 	thinkpad->wmi_device = wdev;
+	thinkpad->value_cache = value_cache;
+	ratelimit_state_init(&thinkpad->read_limit, DEFAULT_RATELIMIT_INTERVAL,
+			     DEFAULT_RATELIMIT_BURST);
+	/* Throttling is counted in read_throttled, not logged */
+	ratelimit_set_flags(&thinkpad->read_limit, RATELIMIT_MSG_ON_RELEASE);
+	mutex_init(&thinkpad->lock);
+	mutex_init(&thinkpad->rescan_lock);
+	mutex_init(&thinkpad->call_lock);
+	init_waitqueue_head(&thinkpad->bulk_wait);
+	spin_lock_init(&thinkpad->call_stats_lock);
+	mutex_init(&thinkpad->audit.lock);
+	mutex_init(&thinkpad->trace_lock);
+	INIT_WORK(&thinkpad->revalidate_work, thinkpad_wmi_revalidate_work);
 	dev_set_drvdata(&wdev->dev, thinkpad);
 
+	if (kfifo_alloc(&thinkpad->trace, THINKPAD_WMI_TRACE_SIZE, GFP_KERNEL))
+		pr_warn("No memory for the trace, recording is unavailable\n");
+
+	err = thinkpad_wmi_load_replay(thinkpad);
+	if (err)
+		pr_warn("Failed to load replay %s: %d\n", replay, err);
+
+	thinkpad->table = vmalloc_user(sizeof(*thinkpad->table));
+	if (thinkpad->table) {
+		thinkpad->table->magic = THINKPAD_WMI_TABLE_MAGIC;
+		thinkpad->table->version = THINKPAD_WMI_TABLE_VERSION;
+		thinkpad->table->count = LENOVO_MAX_SETTINGS;
+		thinkpad->table->entry_size =
+			sizeof(struct thinkpad_wmi_table_entry);
+	} else {
+		pr_warn("No memory for the settings table\n");
+	}
+
+	thinkpad->digest_tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(thinkpad->digest_tfm)) {
+		pr_warn("No SHA-256, config_digest is unavailable\n");
+		thinkpad->digest_tfm = NULL;
+	}
+
 	thinkpad_wmi_analyze(thinkpad);
+	thinkpad_wmi_load_order(thinkpad);
+	thinkpad_wmi_load_profile(thinkpad);
 
 	err = thinkpad_wmi_platform_init(thinkpad);
 	if (err)
@@ -1274,25 +4771,19 @@ static int thinkpad_wmi_add(struct wmi_device *wdev)
 error_debugfs:
 	thinkpad_wmi_platform_exit(thinkpad);
 error_platform:
-	kfree(thinkpad);
+	thinkpad_wmi_free(thinkpad);
 	return err;
 }
 
 static int thinkpad_wmi_remove(struct wmi_device *wdev)
 {
 	struct thinkpad_wmi *thinkpad;
-	int i;
 
 	thinkpad = dev_get_drvdata(&wdev->dev);
+	cancel_work_sync(&thinkpad->revalidate_work);
 	thinkpad_wmi_debugfs_exit(thinkpad);
 	thinkpad_wmi_platform_exit(thinkpad);
-
-	for (i = 0; thinkpad->settings[i]; ++i) {
-		kfree(thinkpad->settings[i]);
-		thinkpad->settings[i] = NULL;
-	}
-
-	kfree(thinkpad);
+	thinkpad_wmi_free(thinkpad);
 	return 0;
 }
 
@@ -1305,6 +4796,39 @@ static int thinkpad_wmi_probe(struct wmi_device *wdev)
 	return thinkpad_wmi_add(wdev);
 }
 
+#ifdef CONFIG_PM_SLEEP
+/*
+ * The BIOS setup may have been entered between hibernation and restore.
+ * Don't trust what is known until read again, but don't delay the resume
+ * either: suspect settings are read back in the background, and read from
+ * the firmware if used before that.
+ */
+static int thinkpad_wmi_restore(struct device *dev)
+{
+	struct thinkpad_wmi *thinkpad = dev_get_drvdata(dev);
+	int i;
+
+	mutex_lock(&thinkpad->lock);
+	for (i = 0; i < LENOVO_MAX_SETTINGS; i++) {
+		if (thinkpad->settings[i].name)
+			thinkpad->settings[i].suspect = true;
+	}
+	thinkpad->pcfg_valid = false;
+	thinkpad_wmi_fill_table(thinkpad);
+	mutex_unlock(&thinkpad->lock);
+
+	/* Hundreds of firmware calls, keep them off system_wq */
+	queue_work(system_long_wq, &thinkpad->revalidate_work);
+	return 0;
+}
+#endif
+
+static const struct dev_pm_ops thinkpad_wmi_pm_ops = {
+#ifdef CONFIG_PM_SLEEP
+	.restore = thinkpad_wmi_restore,
+#endif
+};
+
 static const struct wmi_device_id thinkpad_wmi_id_table[] = {
 	// Search for Lenovo_BiosSetting
 	{ .guid_string = LENOVO_BIOS_SETTING_GUID },
@@ -1314,6 +4838,7 @@ static const struct wmi_device_id thinkpad_wmi_id_table[] = {
 static struct wmi_driver thinkpad_wmi_driver = {
 	.driver = {
 		.name = "thinkpad-wmi",
+		.pm = &thinkpad_wmi_pm_ops,
 	},
 	.id_table = thinkpad_wmi_id_table,
 	.probe = thinkpad_wmi_probe,
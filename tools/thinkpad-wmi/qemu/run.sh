@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# Boot a kernel in QEMU (TCG) with the emulated Lenovo WMI interface of
+# ssdt.asl, and run the probe, read and write paths, the stress tool and the
+# benchmarks of thinkpad-wmi in it, see "Testing in QEMU" in README.md.
+#
+# Needs iasl, qemu-system-x86_64, cpio, a static busybox and the headers of the
+# kernel. Prints the console, and exits with 0 if every step passed.
+#
+set -e
+
+usage() {
+	echo "Usage: $0 [-k KERNEL] [-v KVER] [-s SECONDS] [-o DIR]" >&2
+	exit 2
+}
+
+here=$(cd "$(dirname "$0")" && pwd)
+top=$here/../../..
+tools=$here/..
+
+kver=$(uname -r)
+kernel=
+seconds=10
+out=$here/out
+
+while getopts k:v:s:o:h opt; do
+	case $opt in
+	k) kernel=$OPTARG ;;
+	v) kver=$OPTARG ;;
+	s) seconds=$OPTARG ;;
+	o) out=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+[ -n "$kernel" ] || kernel=/boot/vmlinuz-$kver
+
+busybox=${BUSYBOX:-$(command -v busybox || true)}
+for tool in iasl qemu-system-x86_64 cpio "$busybox"; do
+	if [ -z "$tool" ] || ! command -v "$tool" >/dev/null; then
+		echo "$0: ${tool:-busybox} not found" >&2
+		exit 1
+	fi
+done
+
+rm -rf "$out"
+mkdir -p "$out/root/bin" "$out/root/lib/modules" "$out/root/proc" \
+	 "$out/root/sys" "$out/root/dev"
+
+# The table
+iasl -p "$out/ssdt" "$here/ssdt.asl" >/dev/null
+
+# The driver, for the kernel that boots
+make -C "$top/drivers/platform/x86" KVER="$kver"
+cp "$top/drivers/platform/x86/thinkpad-wmi.ko" "$out/root/"
+
+# The tools, static since there is no libc in the initramfs
+for prog in thinkpad-wmi-cli:thinkpad-wmi \
+	    thinkpad-wmi-stress:thinkpad-wmi-stress; do
+	${CXX:-g++} -std=c++17 -O2 -pthread -static -I"$tools" \
+		-o "$out/root/bin/${prog#*:}" "$tools/${prog%%:*}.cpp" \
+		"$tools/thinkpad_wmi.cpp" "$tools/trace.cpp"
+done
+
+# The WMI core and what it needs, uncompressed, in load order
+modprobe -S "$kver" --show-depends wmi | while read -r cmd path rest; do
+	[ "$cmd" = insmod ] || continue
+	name=$(basename "$path")
+	case $name in
+	*.zst) zstd -dc "$path" > "$out/root/lib/modules/${name%.zst}" ;;
+	*.xz) xz -dc "$path" > "$out/root/lib/modules/${name%.xz}" ;;
+	*.gz) gzip -dc "$path" > "$out/root/lib/modules/${name%.gz}" ;;
+	*) cp "$path" "$out/root/lib/modules/" ;;
+	esac
+	name=${name%.zst}; name=${name%.xz}; name=${name%.gz}
+	echo "$name" >> "$out/root/modules.list"
+done
+touch "$out/root/modules.list"
+
+cp "$busybox" "$out/root/bin/busybox"
+for applet in sh mount insmod cat echo grep wc head sed time poweroff; do
+	ln -s busybox "$out/root/bin/$applet"
+done
+cp "$here/init" "$out/root/init"
+chmod 755 "$out/root/init"
+(cd "$out/root" && find . | cpio -o -H newc --quiet) | gzip > "$out/initramfs.gz"
+
+qemu-system-x86_64 -accel tcg -m 512 -smp 2 -nographic -no-reboot \
+	-kernel "$kernel" -initrd "$out/initramfs.gz" \
+	-acpitable file="$out/ssdt.aml" \
+	-append "console=ttyS0 panic=-1 rdinit=/init quiet STRESS_SECONDS=$seconds" \
+	| tee "$out/console.log"
+
+grep -q '^RIG: PASS' "$out/console.log"
@@ -0,0 +1,222 @@
+/*
+ * Tests of the thinkpad-wmi client library, on a fake sysfs directory
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "thinkpad_wmi.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <ftw.h>
+#include <unistd.h>
+
+using namespace thinkpad_wmi;
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			std::fprintf(stderr, "%s:%d: %s\n",		\
+				     __FILE__, __LINE__, #cond);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+static void put(const std::string &path, const std::string &data)
+{
+	std::ofstream(path) << data;
+}
+
+static std::string get(const std::string &path)
+{
+	std::stringstream ss;
+
+	ss << std::ifstream(path).rdbuf();
+	return ss.str();
+}
+
+static int remove_entry(const char *path, const struct stat *, int,
+			struct FTW *)
+{
+	return remove(path);
+}
+
+/* A directory laid out as the driver's, with or without the bulk files */
+class fake_sysfs {
+public:
+	explicit fake_sysfs(bool bulk)
+	{
+		char tmpl[] = "/tmp/thinkpad-wmi.XXXXXX";
+
+		root = mkdtemp(tmpl);
+		put(root + "/WakeOnLAN", "Enable\nDisable,Enable\n");
+		put(root + "/BootOrder", "USBHDD:HDD0\nUSBHDD,HDD0\n");
+		put(root + "/Boot\\Mode", "UEFI\nUEFI,Legacy\n");
+		put(root + "/password", "");
+		put(root + "/password_encoding", "ascii\n");
+		put(root + "/password_kbd_lang", "us\n");
+		put(root + "/password_settings", "password_state: 0x00\n");
+		put(root + "/generation", "1\n");
+		put(root + "/uevent", "");
+		if (bulk) {
+			put(root + "/settings",
+			    "WakeOnLAN=Enable\nBootOrder=USBHDD:HDD0\n"
+			    "Boot\\Mode=UEFI\n");
+			put(root + "/apply", "");
+		}
+	}
+
+	~fake_sysfs()
+	{
+		nftw(root.c_str(), remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+	}
+
+	std::string root;
+};
+
+static void test_parse()
+{
+	auto profile = parse_profile("# comment\n\nWakeOnLAN = Disable\n"
+				     "Boot/Mode=Legacy\n");
+	setting s;
+
+	CHECK(profile.size() == 2);
+	CHECK(profile["WakeOnLAN"] == "Disable");
+	CHECK(profile["Boot\\Mode"] == "Legacy");
+
+	try {
+		parse_profile("WakeOnLAN\n");
+		CHECK(!"missing '=' accepted");
+	} catch (const error &e) {
+		CHECK(e.err() == EINVAL);
+	}
+
+	parse_setting("Enable\nDisable,Enable\n", s);
+	CHECK(s.value == "Enable");
+	CHECK(s.choices.size() == 2);
+	CHECK(s.choices[0] == "Disable" && s.choices[1] == "Enable");
+
+	parse_setting("Enable\n", s);
+	CHECK(s.value == "Enable");
+	CHECK(s.choices.empty());
+}
+
+static void test_enumerate(bool bulk)
+{
+	fake_sysfs fs(bulk);
+	client c(fs.root);
+	std::map<std::string, std::string> values;
+
+	for (auto &s : c.settings())
+		values[s.name] = s.value;
+	CHECK(values.size() == 3);
+	CHECK(values["WakeOnLAN"] == "Enable");
+	CHECK(values["BootOrder"] == "USBHDD:HDD0");
+	CHECK(values["Boot\\Mode"] == "UEFI");
+
+	/* Read once */
+	c.settings();
+	CHECK(c.timings().size() == 1);
+	CHECK(c.timings()[0].name == "enumerate");
+
+	setting s = c.read("Boot/Mode");
+	CHECK(s.value == "UEFI");
+	CHECK(s.choices.size() == 2);
+
+	/* A second read goes through the file again */
+	put(fs.root + "/Boot\\Mode", "Legacy\nUEFI,Legacy\n");
+	CHECK(c.read("Boot\\Mode").value == "Legacy");
+}
+
+static void test_apply(bool bulk)
+{
+	fake_sysfs fs(bulk);
+	client c(fs.root);
+	auto changes = c.diff(parse_profile("WakeOnLAN=Enable\n"
+					    "Boot/Mode=Legacy\n"));
+
+	CHECK(changes.size() == 1);
+	CHECK(changes[0].name == "Boot\\Mode");
+	CHECK(changes[0].from == "UEFI");
+	CHECK(changes[0].to == "Legacy");
+
+	c.apply(changes);
+	if (bulk) {
+		CHECK(get(fs.root + "/apply") == "Boot\\Mode=Legacy\n");
+		CHECK(get(fs.root + "/Boot\\Mode") == "UEFI\nUEFI,Legacy\n");
+	} else {
+		CHECK(get(fs.root + "/Boot\\Mode") == "Legacy\n");
+	}
+	/* Unchanged settings are not written */
+	CHECK(get(fs.root + "/WakeOnLAN") == "Enable\nDisable,Enable\n");
+
+	/* Applied values are known without reading them again */
+	CHECK(c.diff(parse_profile("Boot/Mode=Legacy\n")).empty());
+
+	try {
+		c.diff(parse_profile("NoSuchSetting=Enable\n"));
+		CHECK(!"unknown setting accepted");
+	} catch (const error &e) {
+		CHECK(e.err() == ENOENT);
+	}
+}
+
+static void test_apply_split()
+{
+	fake_sysfs fs(true);
+	client c(fs.root);
+	std::vector<change> changes;
+
+	/* Larger than a page: refused rather than split */
+	for (int i = 0; i < 300; i++)
+		changes.push_back({ "WakeOnLAN", "Enable", "Disable" });
+	try {
+		c.apply(changes);
+		CHECK(false);
+	} catch (const error &e) {
+		CHECK(e.err() == E2BIG);
+	}
+	CHECK(get(fs.root + "/apply").empty());
+}
+
+static void test_auth()
+{
+	fake_sysfs fs(true);
+	client c(fs.root);
+
+	c.set_auth("secret", "scancode", "fr");
+	CHECK(get(fs.root + "/password") == "secret\n");
+	CHECK(get(fs.root + "/password_encoding") == "scancode\n");
+	CHECK(get(fs.root + "/password_kbd_lang") == "fr\n");
+
+	c.clear_auth();
+	CHECK(get(fs.root + "/password") == "\n");
+}
+
+int main()
+{
+	test_parse();
+	test_enumerate(true);
+	test_enumerate(false);
+	test_apply(true);
+	test_apply(false);
+	test_apply_split();
+	test_auth();
+
+	if (failures) {
+		std::fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	std::printf("test_thinkpad_wmi: ok\n");
+	return 0;
+}
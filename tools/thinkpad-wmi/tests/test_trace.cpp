@@ -0,0 +1,186 @@
+/*
+ * Tests of the trace parser and of the invariants of the stress tool
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "trace.h"
+
+#include <cstdio>
+
+using namespace thinkpad_wmi;
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			std::fprintf(stderr, "%s:%d: %s\n",		\
+				     __FILE__, __LINE__, #cond);	\
+			failures++;					\
+		}							\
+	} while (0)
+
+static call make(const char *op, const std::string &input,
+		 unsigned status = 0)
+{
+	call c;
+
+	c.op = op;
+	c.status = status;
+	c.input = input;
+	c.type = 's';
+	c.output = "Success";
+	return c;
+}
+
+static void test_parse()
+{
+	/* "WakeOnLAN,Enable;" then "Success" */
+	auto calls = parse_trace(
+		"set_bios_settings 0 1500 0 "
+		"57616b654f6e4c414e2c456e61626c653b s 53756363657373\n"
+		"\n"
+		"save_bios_settings 0 900 0 - s 53756363657373\n"
+		"bios_setting 3 100 5 - - -\n");
+
+	CHECK(calls.size() == 3);
+	CHECK(calls[0].op == "set_bios_settings");
+	CHECK(calls[0].latency_ns == 1500);
+	CHECK(calls[0].input == "WakeOnLAN,Enable;");
+	CHECK(calls[0].output == "Success");
+	CHECK(calls[1].input.empty());
+	CHECK(calls[2].instance == 3 && calls[2].status == 5);
+	CHECK(calls[2].type == '-' && calls[2].output.empty());
+
+	CHECK(format_call(calls[0]) ==
+	      "set_bios_settings 0 1500 0 "
+	      "57616b654f6e4c414e2c456e61626c653b s 53756363657373");
+	CHECK(format_call(calls[2]) == "bios_setting 3 100 5 - - -");
+
+	for (const char *bad : { "set_bios_settings 0 1 0 5 s 00\n",
+				 "set_bios_settings 0 1 0 zz s 00\n",
+				 "set_bios_settings 0 1 0 -\n" }) {
+		try {
+			parse_trace(bad);
+			CHECK(!"invalid trace accepted");
+		} catch (const error &e) {
+			CHECK(e.err() == EINVAL);
+		}
+	}
+}
+
+static void test_set_save()
+{
+	std::set<std::string> saved = { "Boot\\Mode", "WakeOnLAN" };
+
+	/* Pairs, with debugfs sets that are never saved around them */
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("save_bios_settings", ""),
+			       make("set_bios_settings", "Debug,Enable;"),
+			       make("bios_setting", ""),
+			       make("set_bios_settings", "Boot/Mode,UEFI"),
+			       make("save_bios_settings", "") },
+			     saved).empty());
+
+	/* Each call made twice, as the driver does */
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("save_bios_settings", ""),
+			       make("save_bios_settings", "") },
+			     saved).empty());
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("set_bios_settings", "Debug,Enable;"),
+			       make("set_bios_settings", "Debug,Enable;"),
+			       make("save_bios_settings", ""),
+			       make("save_bios_settings", "") },
+			     saved).size() == 1);
+
+	/* A set staged by someone else between a set and its save */
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("set_bios_settings", "Debug,Enable;"),
+			       make("save_bios_settings", "") },
+			     saved).size() == 1);
+
+	/* After a discard, nothing is staged */
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("discard_bios_settings", ""),
+			       make("save_bios_settings", "") },
+			     saved).size() == 1);
+
+	/* A second save of the same set, each made twice */
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("save_bios_settings", ""),
+			       make("save_bios_settings", ""),
+			       make("save_bios_settings", ""),
+			       make("save_bios_settings", "") },
+			     saved).size() == 1);
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("save_bios_settings", ""),
+			       make("save_bios_settings", ""),
+			       make("save_bios_settings", "") },
+			     saved).size() == 1);
+
+	/* Failed calls change nothing */
+	CHECK(check_set_save({ make("set_bios_settings", "WakeOnLAN,Enable;"),
+			       make("set_bios_settings", "Debug,Enable;", 5),
+			       make("save_bios_settings", "") },
+			     saved).empty());
+}
+
+static void test_torn()
+{
+	std::set<std::string> written = { "", "short", "a-longer-password" };
+
+	CHECK(!is_torn("", written));
+	CHECK(!is_torn("a-longer-password", written));
+	CHECK(is_torn("shortr-password", written));
+	CHECK(is_torn("a-lon", written));
+}
+
+static void test_emulate()
+{
+	auto calls = parse_trace(emulate({ { "Boot\\Mode", "UEFI",
+					     { "UEFI", "Legacy" } },
+					   { "WakeOnLAN", "Enable",
+					     { "Disable", "Enable" } } },
+					 1000));
+	unsigned sets = 0, saves = 0;
+
+	CHECK(calls[0].op == "bios_setting" && calls[0].instance == 0);
+	CHECK(calls[0].output == "Boot/Mode,UEFI");
+	for (auto &c : calls) {
+		CHECK(c.latency_ns == 1000);
+		if (c.op == "get_bios_selections" && c.input == "WakeOnLAN")
+			CHECK(c.output == "Disable,Enable");
+		if (c.op == "bios_setting" && c.instance == 1)
+			CHECK(c.output == "WakeOnLAN,Enable");
+		sets += c.op == "set_bios_settings";
+		saves += c.op == "save_bios_settings";
+	}
+	/* With and without a password, for each choice */
+	CHECK(sets == 8);
+	CHECK(saves == 1);
+}
+
+int main()
+{
+	test_parse();
+	test_set_save();
+	test_torn();
+	test_emulate();
+
+	if (failures) {
+		std::fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	std::printf("test_trace: ok\n");
+	return 0;
+}
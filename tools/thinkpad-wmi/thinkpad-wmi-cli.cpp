@@ -0,0 +1,163 @@
+/*
+ * Command line client for the thinkpad-wmi sysfs interface
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "thinkpad_wmi.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace thinkpad_wmi;
+
+static void usage(const char *prog)
+{
+	std::cerr << "Usage: " << prog << " [--root DIR] [--timings] COMMAND\n"
+		  << "\n"
+		  << "Commands:\n"
+		  << "  list                list settings and their values\n"
+		  << "  get NAME            show a setting and its choices\n"
+		  << "  diff PROFILE        show what applying PROFILE changes\n"
+		  << "  apply PROFILE       write the settings PROFILE changes\n"
+		  << "\n"
+		  << "apply options:\n"
+		  << "  --password-file F   read the BIOS password from F\n"
+		  << "  --encoding E        password encoding (ascii, scancode)\n"
+		  << "  --kbd-lang L        keyboard language (us, fr, gr)\n"
+		  << "\n"
+		  << "PROFILE is a file of Item=Value lines, '-' for stdin.\n";
+}
+
+static std::string slurp(const std::string &path)
+{
+	std::stringstream ss;
+
+	if (path == "-") {
+		ss << std::cin.rdbuf();
+		return ss.str();
+	}
+
+	std::ifstream in(path);
+
+	if (!in)
+		throw error(path, errno);
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+static void print_timings(const client &c)
+{
+	std::fprintf(stderr, "%-12s %10s %8s\n", "phase", "time_us", "calls");
+	for (auto &p : c.timings())
+		std::fprintf(stderr, "%-12s %10lld %8u\n", p.name.c_str(),
+			     (long long)p.time.count(), p.calls);
+}
+
+static void print_changes(const std::vector<change> &changes)
+{
+	for (auto &c : changes)
+		std::cout << c.name << ": " << c.from << " -> " << c.to << "\n";
+}
+
+int main(int argc, char **argv)
+{
+	std::string root, password_file, encoding, kbd_lang;
+	std::vector<std::string> args;
+	bool timings = false;
+	int ret = 0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (arg == "--root" && has_value) {
+			root = argv[++i];
+		} else if (arg == "--timings") {
+			timings = true;
+		} else if (arg == "--password-file" && has_value) {
+			password_file = argv[++i];
+		} else if (arg == "--encoding" && has_value) {
+			encoding = argv[++i];
+		} else if (arg == "--kbd-lang" && has_value) {
+			kbd_lang = argv[++i];
+		} else if (arg == "-h" || arg == "--help") {
+			usage(argv[0]);
+			return 0;
+		} else if (arg.size() > 1 && arg[0] == '-' && arg != "-") {
+			usage(argv[0]);
+			return 2;
+		} else {
+			args.push_back(arg);
+		}
+	}
+
+	if (args.empty() ||
+	    (args[0] == "list" && args.size() != 1) ||
+	    (args[0] != "list" && args.size() != 2)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	try {
+		client c(root);
+
+		if (args[0] == "list") {
+			for (auto &s : c.settings())
+				std::cout << s.name << "=" << s.value << "\n";
+		} else if (args[0] == "get") {
+			setting s = c.read(args[1]);
+			const char *sep = "";
+
+			std::cout << s.value << "\n";
+			for (auto &choice : s.choices) {
+				std::cout << sep << choice;
+				sep = ",";
+			}
+			std::cout << "\n";
+		} else if (args[0] == "diff") {
+			auto changes = c.diff(parse_profile(slurp(args[1])));
+
+			print_changes(changes);
+			ret = changes.empty() ? 0 : 1;
+		} else if (args[0] == "apply") {
+			auto changes = c.diff(parse_profile(slurp(args[1])));
+
+			if (!password_file.empty()) {
+				std::string password = slurp(password_file);
+
+				password.erase(password.find_last_not_of("\r\n") + 1);
+				c.set_auth(password, encoding, kbd_lang);
+			}
+			try {
+				c.apply(changes);
+			} catch (...) {
+				if (!password_file.empty())
+					c.clear_auth();
+				throw;
+			}
+			if (!password_file.empty())
+				c.clear_auth();
+			print_changes(changes);
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+
+		if (timings)
+			print_timings(c);
+	} catch (const std::exception &e) {
+		std::cerr << argv[0] << ": " << e.what() << "\n";
+		return 3;
+	}
+
+	return ret;
+}
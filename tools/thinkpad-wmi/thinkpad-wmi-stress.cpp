@@ -0,0 +1,398 @@
+/*
+ * Concurrent stress of the thinkpad-wmi sysfs and debugfs interfaces
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "thinkpad_wmi.h"
+#include "trace.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace thinkpad_wmi;
+using std::chrono::steady_clock;
+
+static const char *replay_param = "/sys/module/thinkpad_wmi/parameters/replay";
+
+/* Violations shown, the others are only counted */
+static const size_t max_violations = 10;
+
+/* Passwords of different lengths, so that a mix of two shows */
+static const char *passwords[] = { "stress", "stress-password-2" };
+
+struct options {
+	std::string root;
+	std::string debugfs = "/sys/kernel/debug/thinkpad-wmi";
+	unsigned threads = 4;
+	unsigned seconds = 10;
+	bool force = false;
+};
+
+/* Counters of one operation type, summed over its threads */
+struct stats {
+	const char *name;
+	unsigned threads = 0;
+	unsigned long ops = 0;
+	unsigned long errors = 0;
+	uint64_t total_ns = 0;
+	uint64_t max_ns = 0;
+};
+
+struct state {
+	options opts;
+	std::vector<setting> settings;
+	std::string written;	/* set and saved through sysfs */
+	std::string staged;	/* set through debugfs, never saved */
+
+	std::atomic<bool> stop{ false };
+	std::mutex lock;
+	std::vector<stats> results;
+	std::vector<std::string> torn;
+};
+
+static void usage(const char *prog)
+{
+	std::cerr << "Usage: " << prog << " [OPTIONS]\n"
+		  << "       " << prog << " --emulate FILE [--settings N] "
+		  << "[--latency-us US]\n"
+		  << "\n"
+		  << "  --root DIR        sysfs directory of the driver\n"
+		  << "  --debugfs DIR     debugfs directory of the driver\n"
+		  << "  --threads N       threads per operation (default 4)\n"
+		  << "  --seconds S       duration (default 10)\n"
+		  << "  --force           run without replay=, on the firmware\n"
+		  << "\n"
+		  << "--emulate writes a trace for the replay= module parameter,\n"
+		  << "with N settings (default 16) answered in US microseconds.\n";
+}
+
+static std::string slurp(const std::string &path)
+{
+	std::ifstream in(path);
+	std::string data;
+
+	if (!in)
+		throw error(path, errno);
+	std::getline(in, data, '\0');
+	if (in.bad())
+		throw error(path, errno ? errno : EIO);
+	return data;
+}
+
+static void spit(const std::string &path, const std::string &data)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+	ssize_t len;
+
+	if (fd < 0)
+		throw error(path, errno);
+	len = write(fd, data.data(), data.size());
+	if (len < 0) {
+		int err = errno;
+
+		close(fd);
+		throw error(path, err);
+	}
+	close(fd);
+}
+
+static bool replaying()
+{
+	std::string value;
+
+	try {
+		value = slurp(replay_param);
+	} catch (const error &) {
+		return false;
+	}
+	value.erase(value.find_last_not_of("\n") + 1);
+	return !value.empty() && value != "(null)";
+}
+
+/* Run op in a loop until stopped, timing each call */
+static void worker(state &st, const char *name,
+		   void (*op)(state &, unsigned long))
+{
+	stats s;
+	unsigned long i;
+
+	s.name = name;
+	s.threads = 1;
+	for (i = 0; !st.stop; i++) {
+		auto start = steady_clock::now();
+		uint64_t ns;
+
+		try {
+			op(st, i);
+		} catch (const error &) {
+			s.errors++;
+		}
+		ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			steady_clock::now() - start).count();
+		s.ops++;
+		s.total_ns += ns;
+		s.max_ns = std::max(s.max_ns, ns);
+	}
+
+	std::lock_guard<std::mutex> guard(st.lock);
+	for (auto &r : st.results) {
+		if (!std::strcmp(r.name, s.name)) {
+			r.threads++;
+			r.ops += s.ops;
+			r.errors += s.errors;
+			r.total_ns += s.total_ns;
+			r.max_ns = std::max(r.max_ns, s.max_ns);
+			return;
+		}
+	}
+	st.results.push_back(s);
+}
+
+static void read_settings(state &st, unsigned long i)
+{
+	static thread_local std::unique_ptr<client> c;
+
+	if (!c)
+		c.reset(new client(st.opts.root));
+	c->read(st.settings[i % st.settings.size()].name);
+}
+
+static void write_setting(state &st, unsigned long i)
+{
+	static thread_local std::unique_ptr<client> c;
+	const setting *s = nullptr;
+
+	if (!c)
+		c.reset(new client(st.opts.root));
+	for (auto &known : st.settings) {
+		if (known.name == st.written)
+			s = &known;
+	}
+	c->write_file(s->name, s->choices[i % s->choices.size()] + "\n");
+}
+
+static void write_password(state &st, unsigned long i)
+{
+	static thread_local std::unique_ptr<client> c;
+	static const std::set<std::string> written = {
+		"", passwords[0], passwords[1] };
+	std::string value;
+
+	if (!c)
+		c.reset(new client(st.opts.root));
+	c->write_file("password", std::string(passwords[i % 2]) + "\n");
+
+	value = c->read_file("password");
+	value.erase(value.find_last_not_of("\n") + 1);
+	if (is_torn(value, written)) {
+		std::lock_guard<std::mutex> guard(st.lock);
+
+		st.torn.push_back(value);
+	}
+}
+
+/* The argument and set_bios_settings pair, like a debugfs user does */
+static void debugfs_set(state &st, unsigned long i)
+{
+	const setting *s = nullptr;
+
+	for (auto &known : st.settings) {
+		if (known.name == st.staged)
+			s = &known;
+	}
+	spit(st.opts.debugfs + "/argument",
+	     s->name + "," + s->choices[i % s->choices.size()] + ";\n");
+	slurp(st.opts.debugfs + "/set_bios_settings");
+}
+
+/* Keep the trace from filling up while the workers run */
+static void drain(state &st, std::string &trace)
+{
+	std::string path = st.opts.debugfs + "/trace";
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	char buf[65536];
+	bool last = false;
+
+	if (fd < 0) {
+		std::cerr << path << ": " << std::strerror(errno) << "\n";
+		return;
+	}
+	while (!last) {
+		ssize_t len;
+
+		last = st.stop;
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+			trace.append(buf, len);
+		if (!last)
+			usleep(1000);
+	}
+	close(fd);
+}
+
+static int emulate(const std::string &path, unsigned count,
+		   unsigned latency_us)
+{
+	std::vector<setting> settings;
+	std::ofstream out(path);
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		settings.push_back({ "StressSetting" + std::to_string(i),
+				     "Disable", { "Disable", "Enable" } });
+	out << emulate(settings, latency_us * 1000ull);
+	if (!out) {
+		std::cerr << path << ": " << std::strerror(errno) << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+static void report(const state &st, unsigned seconds)
+{
+	std::printf("%-14s %8s %10s %8s %10s %10s %10s\n", "operation",
+		    "threads", "ops", "errors", "ops/s", "avg_us", "max_us");
+	for (auto &r : st.results) {
+		std::printf("%-14s %8u %10lu %8lu %10.1f %10.1f %10.1f\n",
+			    r.name, r.threads, r.ops, r.errors,
+			    seconds ? (double)r.ops / seconds : 0.0,
+			    r.ops ? r.total_ns / 1000.0 / r.ops : 0.0,
+			    r.max_ns / 1000.0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string emulate_path;
+	unsigned emulate_count = 16, latency_us = 0;
+	std::vector<std::string> violations;
+	std::vector<std::thread> threads;
+	std::string trace, dropped;
+	std::thread drainer;
+	state st;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (arg == "--root" && has_value) {
+			st.opts.root = argv[++i];
+		} else if (arg == "--debugfs" && has_value) {
+			st.opts.debugfs = argv[++i];
+		} else if (arg == "--threads" && has_value) {
+			st.opts.threads = std::stoul(argv[++i]);
+		} else if (arg == "--seconds" && has_value) {
+			st.opts.seconds = std::stoul(argv[++i]);
+		} else if (arg == "--force") {
+			st.opts.force = true;
+		} else if (arg == "--emulate" && has_value) {
+			emulate_path = argv[++i];
+		} else if (arg == "--settings" && has_value) {
+			emulate_count = std::stoul(argv[++i]);
+		} else if (arg == "--latency-us" && has_value) {
+			latency_us = std::stoul(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return arg == "-h" || arg == "--help" ? 0 : 2;
+		}
+	}
+
+	if (!emulate_path.empty())
+		return emulate(emulate_path, emulate_count, latency_us);
+
+	/* Writes and passwords go to the firmware, unless it is emulated */
+	if (!st.opts.force && !replaying()) {
+		std::cerr << argv[0] << ": the driver is not loaded with "
+			  << "replay=, use --force to stress the firmware\n";
+		return 2;
+	}
+
+	try {
+		client c(st.opts.root);
+
+		st.opts.root = c.root();
+		for (auto &s : c.settings()) {
+			setting full = c.read(s.name);
+
+			st.settings.push_back(full);
+			if (full.choices.size() < 2)
+				continue;
+			if (st.written.empty())
+				st.written = full.name;
+			else if (st.staged.empty())
+				st.staged = full.name;
+		}
+		if (st.settings.empty() || st.written.empty()) {
+			std::cerr << argv[0] << ": no setting to write\n";
+			return 2;
+		}
+
+		/* Start from an empty trace */
+		spit(st.opts.debugfs + "/record", "1\n");
+		slurp(st.opts.debugfs + "/trace");
+		dropped = slurp(st.opts.debugfs + "/trace_dropped");
+	} catch (const std::exception &e) {
+		std::cerr << argv[0] << ": " << e.what() << "\n";
+		return 3;
+	}
+
+	drainer = std::thread(drain, std::ref(st), std::ref(trace));
+	for (unsigned i = 0; i < st.opts.threads; i++) {
+		threads.emplace_back(worker, std::ref(st), "read",
+				     read_settings);
+		threads.emplace_back(worker, std::ref(st), "write",
+				     write_setting);
+		threads.emplace_back(worker, std::ref(st), "password",
+				     write_password);
+		if (!st.staged.empty())
+			threads.emplace_back(worker, std::ref(st), "debugfs_set",
+					     debugfs_set);
+	}
+	std::this_thread::sleep_for(std::chrono::seconds(st.opts.seconds));
+	st.stop = true;
+	for (auto &t : threads)
+		t.join();
+	drainer.join();
+
+	try {
+		spit(st.opts.debugfs + "/record", "0\n");
+		spit(st.opts.root + "/password", "\n");
+		if (slurp(st.opts.debugfs + "/trace_dropped") != dropped)
+			violations.push_back("trace dropped records, the "
+					     "check is incomplete");
+		for (auto &v : check_set_save(parse_trace(trace),
+					      { st.written }))
+			violations.push_back(v);
+	} catch (const std::exception &e) {
+		std::cerr << argv[0] << ": " << e.what() << "\n";
+		return 3;
+	}
+	for (auto value : st.torn) {
+		for (size_t pos = 0; (pos = value.find('\n', pos)) !=
+				     std::string::npos; pos += 2)
+			value.replace(pos, 1, "\\n");
+		violations.push_back("torn password '" + value + "'");
+	}
+
+	report(st, st.opts.seconds);
+	for (size_t i = 0; i < violations.size() && i < max_violations; i++)
+		std::printf("FAIL: %s\n", violations[i].c_str());
+	if (violations.size() > max_violations)
+		std::printf("FAIL: %zu more\n",
+			    violations.size() - max_violations);
+	return violations.empty() ? 0 : 1;
+}
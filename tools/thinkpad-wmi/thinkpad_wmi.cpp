@@ -0,0 +1,372 @@
+/*
+ * Client library for the thinkpad-wmi sysfs interface
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "thinkpad_wmi.h"
+
+#include <cerrno>
+#include <cstring>
+#include <set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace thinkpad_wmi {
+
+/* The driver's own files and the ones of the WMI bus, not settings */
+static const std::set<std::string> attributes = {
+	"apply", "apply_order", "audit_dropped", "audit_log", "baseline",
+	"cache_flush", "config_digest", "drift", "drift_count",
+	"driver_override", "expensive", "generation", "guid",
+	"housekeeping_cpus", "instance_count", "layout",
+	"load_default_settings", "modalias", "object_id", "password",
+	"password_change", "password_encoding", "password_kbd_lang",
+	"password_settings", "password_type", "profile_status",
+	"read_limit_burst", "read_limit_interval_ms", "read_throttled",
+	"rescan", "rollback", "setable", "settings", "snapshot", "table",
+	"uevent", "value_cache",
+};
+
+/* Largest write the driver takes at once */
+static const size_t max_write = 4095;
+
+static std::string trim(const std::string &s)
+{
+	size_t start = s.find_first_not_of(" \t\r\n");
+	size_t end = s.find_last_not_of(" \t\r\n");
+
+	if (start == std::string::npos)
+		return "";
+	return s.substr(start, end - start + 1);
+}
+
+/* Setting files are named with '\' for '/' */
+static std::string file_name(const std::string &name)
+{
+	std::string file = name;
+
+	for (char &c : file) {
+		if (c == '/')
+			c = '\\';
+	}
+	return file;
+}
+
+error::error(const std::string &what, int err)
+	: std::runtime_error(what + ": " + std::strerror(err)), err_(err)
+{
+}
+
+std::map<std::string, std::string> parse_profile(const std::string &text)
+{
+	std::map<std::string, std::string> profile;
+	size_t pos = 0;
+
+	while (pos < text.size()) {
+		size_t end = text.find('\n', pos);
+		std::string line;
+		size_t eq;
+
+		if (end == std::string::npos)
+			end = text.size();
+		line = trim(text.substr(pos, end - pos));
+		pos = end + 1;
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		eq = line.find('=');
+		if (eq == std::string::npos)
+			throw error("invalid profile line '" + line + "'", EINVAL);
+		profile[file_name(trim(line.substr(0, eq)))] =
+			trim(line.substr(eq + 1));
+	}
+	return profile;
+}
+
+void parse_setting(const std::string &text, setting &s)
+{
+	size_t end = text.find('\n');
+	std::string choices;
+	size_t pos = 0;
+
+	s.value = trim(text.substr(0, end));
+	s.choices.clear();
+	if (end == std::string::npos)
+		return;
+
+	choices = trim(text.substr(end + 1));
+	while (!choices.empty() && pos <= choices.size()) {
+		size_t comma = choices.find(',', pos);
+
+		if (comma == std::string::npos)
+			comma = choices.size();
+		s.choices.push_back(choices.substr(pos, comma - pos));
+		pos = comma + 1;
+	}
+}
+
+/* Accounts the time and the system calls of a phase */
+class client::timer {
+public:
+	timer(client &c, const char *name)
+		: c_(c), name_(name), calls_(c.calls_),
+		  start_(std::chrono::steady_clock::now())
+	{
+	}
+
+	~timer()
+	{
+		auto time = std::chrono::steady_clock::now() - start_;
+
+		c_.timings_.push_back({ name_,
+			std::chrono::duration_cast<std::chrono::microseconds>(time),
+			c_.calls_ - calls_ });
+	}
+
+private:
+	client &c_;
+	const char *name_;
+	unsigned calls_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+client::client(std::string root) : root_(std::move(root))
+{
+	if (root_.empty())
+		root_ = find_root();
+}
+
+client::~client()
+{
+	for (auto &f : fds_)
+		close(f.second);
+}
+
+/*
+ * The platform device of older versions, or the WMI device the driver is
+ * bound to.
+ */
+std::string client::find_root()
+{
+	static const char *drivers = "/sys/bus/wmi/drivers/thinkpad-wmi";
+	struct stat st;
+	std::string found;
+	DIR *dir;
+
+	if (!stat("/sys/devices/platform/thinkpad-wmi/password", &st))
+		return "/sys/devices/platform/thinkpad-wmi";
+
+	dir = opendir(drivers);
+	if (!dir)
+		throw error(drivers, errno);
+	while (struct dirent *d = readdir(dir)) {
+		std::string path = std::string(drivers) + "/" + d->d_name;
+
+		if (d->d_name[0] != '.' &&
+		    !stat((path + "/password").c_str(), &st)) {
+			found = path;
+			break;
+		}
+	}
+	closedir(dir);
+
+	if (found.empty())
+		throw error(drivers, ENODEV);
+	return found;
+}
+
+bool client::has(const std::string &file) const
+{
+	return !access((root_ + "/" + file).c_str(), F_OK);
+}
+
+int client::fd(const std::string &file)
+{
+	auto it = fds_.find(file);
+	int fd;
+
+	if (it != fds_.end())
+		return it->second;
+
+	calls_++;
+	fd = open((root_ + "/" + file).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw error(file, errno);
+	fds_[file] = fd;
+	return fd;
+}
+
+/* sysfs files are generated again by a read at offset 0 */
+std::string client::read_file(const std::string &file)
+{
+	int f = fd(file);
+	std::string data;
+	char buf[4096];
+	ssize_t len;
+
+	do {
+		calls_++;
+		len = pread(f, buf, sizeof(buf), data.size());
+		if (len < 0)
+			throw error(file, errno);
+		data.append(buf, len);
+	} while (len > 0);
+
+	return data;
+}
+
+void client::write_file(const std::string &file, const std::string &data)
+{
+	ssize_t len;
+	int f;
+
+	calls_ += 3;
+	f = open((root_ + "/" + file).c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (f < 0)
+		throw error(file, errno);
+	len = write(f, data.data(), data.size());
+	if (len < 0) {
+		int err = errno;
+
+		close(f);
+		throw error(file, err);
+	}
+	close(f);
+	if ((size_t)len != data.size())
+		throw error(file, EIO);
+}
+
+void client::enumerate()
+{
+	timer t(*this, "enumerate");
+	DIR *dir;
+
+	settings_.clear();
+	if (has("settings")) {
+		for (auto &p : parse_profile(read_file("settings")))
+			settings_.push_back({ p.first, p.second, {} });
+		enumerated_ = true;
+		return;
+	}
+
+	/* No bulk file: every regular file that is not an attribute */
+	calls_++;
+	dir = opendir(root_.c_str());
+	if (!dir)
+		throw error(root_, errno);
+	while (struct dirent *d = readdir(dir)) {
+		std::string name = d->d_name;
+		struct stat st;
+
+		if (name[0] == '.' || attributes.count(name))
+			continue;
+		calls_++;
+		if (stat((root_ + "/" + name).c_str(), &st) ||
+		    !S_ISREG(st.st_mode))
+			continue;
+
+		setting s;
+
+		s.name = name;
+		parse_setting(read_file(name), s);
+		settings_.push_back(s);
+	}
+	closedir(dir);
+	enumerated_ = true;
+}
+
+const std::vector<setting> &client::settings()
+{
+	if (!enumerated_)
+		enumerate();
+	return settings_;
+}
+
+setting client::read(const std::string &name)
+{
+	timer t(*this, "read");
+	setting s;
+
+	s.name = file_name(name);
+	parse_setting(read_file(s.name), s);
+	for (auto &known : settings_) {
+		if (known.name == s.name)
+			known = s;
+	}
+	return s;
+}
+
+std::vector<change> client::diff(const std::map<std::string, std::string> &profile)
+{
+	std::map<std::string, const setting *> by_name;
+	std::vector<change> changes;
+
+	settings();
+
+	timer t(*this, "diff");
+	for (auto &s : settings_)
+		by_name[s.name] = &s;
+	for (auto &p : profile) {
+		auto it = by_name.find(p.first);
+
+		if (it == by_name.end())
+			throw error("unknown setting '" + p.first + "'", ENOENT);
+		if (it->second->value != p.second)
+			changes.push_back({ p.first, it->second->value,
+					    p.second });
+	}
+	return changes;
+}
+
+void client::apply(const std::vector<change> &changes)
+{
+	timer t(*this, "apply");
+
+	if (changes.empty())
+		return;
+
+	if (has("apply")) {
+		std::string text;
+
+		/* One transaction: a profile split over writes is not one */
+		for (auto &c : changes)
+			text += c.name + "=" + c.to + "\n";
+		if (text.size() > max_write)
+			throw error("apply", E2BIG);
+		write_file("apply", text);
+	} else {
+		for (auto &c : changes)
+			write_file(c.name, c.to + "\n");
+	}
+
+	for (auto &c : changes) {
+		for (auto &s : settings_) {
+			if (s.name == c.name)
+				s.value = c.to;
+		}
+	}
+}
+
+void client::set_auth(const std::string &password,
+		      const std::string &encoding, const std::string &kbd_lang)
+{
+	write_file("password_encoding", encoding + "\n");
+	write_file("password_kbd_lang", kbd_lang + "\n");
+	write_file("password", password + "\n");
+}
+
+void client::clear_auth()
+{
+	write_file("password", "\n");
+}
+
+} /* namespace thinkpad_wmi */
@@ -0,0 +1,113 @@
+/*
+ * Client library for the thinkpad-wmi sysfs interface
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef THINKPAD_WMI_H
+#define THINKPAD_WMI_H
+
+#include <chrono>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace thinkpad_wmi {
+
+/* Failed system call on a sysfs file, with its errno */
+class error : public std::runtime_error {
+public:
+	error(const std::string &what, int err);
+	int err() const { return err_; }
+
+private:
+	int err_;
+};
+
+struct setting {
+	std::string name;	/* file name, '/' in names is '\' */
+	std::string value;
+	std::vector<std::string> choices;	/* empty until read */
+};
+
+struct change {
+	std::string name;
+	std::string from;
+	std::string to;
+};
+
+/* Time spent in each phase, in the order they ran */
+struct phase {
+	std::string name;
+	std::chrono::microseconds time;
+	unsigned calls;	/* system calls on sysfs files */
+};
+
+/* 'Item=Value' lines, as in the driver's settings, apply and baseline */
+std::map<std::string, std::string> parse_profile(const std::string &text);
+/* "value\nchoices\n" of a setting file */
+void parse_setting(const std::string &text, setting &s);
+
+/*
+ * The driver's sysfs directory. Files are opened once and read again from
+ * offset 0, and the bulk settings and apply files are used when present.
+ */
+class client {
+public:
+	/* root is found with find_root() when empty */
+	explicit client(std::string root = "");
+	~client();
+	client(const client &) = delete;
+	client &operator=(const client &) = delete;
+
+	static std::string find_root();
+	const std::string &root() const { return root_; }
+
+	/* Names and values of all settings, read once */
+	const std::vector<setting> &settings();
+	/* Read one setting again, with its choices */
+	setting read(const std::string &name);
+
+	/* Settings of the profile that differ from their current value */
+	std::vector<change> diff(const std::map<std::string, std::string> &profile);
+	/*
+	 * Write the changes, in a single transaction when apply exists. A
+	 * profile larger than one write to apply fails with E2BIG.
+	 */
+	void apply(const std::vector<change> &changes);
+
+	/* Authentication for the next writes, see the password files */
+	void set_auth(const std::string &password,
+		      const std::string &encoding = "",
+		      const std::string &kbd_lang = "");
+	void clear_auth();
+
+	bool has(const std::string &file) const;
+	std::string read_file(const std::string &file);
+	void write_file(const std::string &file, const std::string &data);
+
+	const std::vector<phase> &timings() const { return timings_; }
+
+private:
+	class timer;
+
+	int fd(const std::string &file);
+	void enumerate();
+
+	std::string root_;
+	std::map<std::string, int> fds_;
+	std::vector<setting> settings_;
+	bool enumerated_ = false;
+	std::vector<phase> timings_;
+	unsigned calls_ = 0;
+};
+
+} /* namespace thinkpad_wmi */
+
+#endif /* THINKPAD_WMI_H */
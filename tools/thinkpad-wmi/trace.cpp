@@ -0,0 +1,192 @@
+/*
+ * Firmware call traces of the thinkpad-wmi debugfs interface
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include "trace.h"
+
+#include <cctype>
+#include <cerrno>
+#include <sstream>
+
+namespace thinkpad_wmi {
+
+static std::string from_hex(const std::string &hex)
+{
+	std::string data;
+
+	if (hex == "-")
+		return data;
+	if (hex.size() % 2)
+		throw error("invalid hex '" + hex + "'", EINVAL);
+
+	for (size_t i = 0; i < hex.size(); i += 2) {
+		if (!std::isxdigit((unsigned char)hex[i]) ||
+		    !std::isxdigit((unsigned char)hex[i + 1]))
+			throw error("invalid hex '" + hex + "'", EINVAL);
+		data += (char)std::stoi(hex.substr(i, 2), nullptr, 16);
+	}
+	return data;
+}
+
+static std::string to_hex(const std::string &data)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex;
+
+	if (data.empty())
+		return "-";
+	for (unsigned char c : data) {
+		hex += digits[c >> 4];
+		hex += digits[c & 0xf];
+	}
+	return hex;
+}
+
+/* The firmware knows names with '/' */
+static std::string firmware_name(const std::string &name)
+{
+	std::string s = name;
+
+	for (char &c : s) {
+		if (c == '\\')
+			c = '/';
+	}
+	return s;
+}
+
+std::vector<call> parse_trace(const std::string &text)
+{
+	std::istringstream in(text);
+	std::vector<call> calls;
+	std::string line;
+
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::string input, type, output;
+		call c;
+
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		if (!(fields >> c.op >> c.instance >> c.latency_ns >> c.status >>
+		      input >> type >> output) || type.size() != 1)
+			throw error("invalid trace line '" + line + "'", EINVAL);
+		c.input = from_hex(input);
+		c.type = type[0];
+		c.output = from_hex(output);
+		calls.push_back(c);
+	}
+	return calls;
+}
+
+std::string format_call(const call &c)
+{
+	std::ostringstream out;
+
+	out << c.op << " " << c.instance << " " << c.latency_ns << " "
+	    << c.status << " " << to_hex(c.input) << " " << c.type << " "
+	    << to_hex(c.output);
+	return out.str();
+}
+
+std::vector<std::string> check_set_save(const std::vector<call> &calls,
+					const std::set<std::string> &saved)
+{
+	std::set<std::string> items;
+	std::vector<std::string> violations;
+	const call *last = nullptr;
+	bool repeated = false;
+	size_t i;
+
+	for (auto &name : saved)
+		items.insert(firmware_name(name));
+
+	for (i = 0; i < calls.size(); i++) {
+		const call &c = calls[i];
+		std::string item;
+
+		if (c.status)
+			continue;
+		if (c.op != "set_bios_settings" &&
+		    c.op != "save_bios_settings" &&
+		    c.op != "discard_bios_settings")
+			continue;
+		/* The driver makes each of these calls twice, no more */
+		if (!repeated && last && last->op == c.op &&
+		    last->input == c.input) {
+			repeated = true;
+			continue;
+		}
+		repeated = false;
+		if (c.op != "save_bios_settings") {
+			last = &c;
+			continue;
+		}
+
+		if (!last || last->op != "set_bios_settings") {
+			violations.push_back("call " + std::to_string(i) +
+					     ": save without a set");
+		} else {
+			item = last->input.substr(0, last->input.find(','));
+			if (!items.count(firmware_name(item)))
+				violations.push_back(
+					"call " + std::to_string(i) +
+					": save after a set of " + item);
+		}
+		last = &c;
+	}
+	return violations;
+}
+
+bool is_torn(const std::string &value, const std::set<std::string> &written)
+{
+	return !written.count(value);
+}
+
+std::string emulate(const std::vector<setting> &settings, uint64_t latency_ns)
+{
+	std::string trace;
+	unsigned i;
+
+	auto add = [&](const char *op, unsigned instance,
+		       const std::string &input, const std::string &output) {
+		call c;
+
+		c.op = op;
+		c.instance = instance;
+		c.latency_ns = latency_ns;
+		c.input = input;
+		c.type = 's';
+		c.output = output;
+		trace += format_call(c) + "\n";
+	};
+
+	for (i = 0; i < settings.size(); i++) {
+		const setting &s = settings[i];
+		std::string name = firmware_name(s.name);
+		std::string choices;
+
+		add("bios_setting", i, "", name + "," + s.value);
+		for (auto &choice : s.choices) {
+			choices += (choices.empty() ? "" : ",") + choice;
+			/* Without a password, and cut before it */
+			add("set_bios_settings", 0, name + "," + choice + ";",
+			    "Success");
+			add("set_bios_settings", 0, name + "," + choice,
+			    "Success");
+		}
+		add("get_bios_selections", 0, name, choices);
+	}
+	/* Save and discard inputs are only passwords, never traced */
+	add("save_bios_settings", 0, "", "Success");
+	add("discard_bios_settings", 0, "", "Success");
+	return trace;
+}
+
+} /* namespace thinkpad_wmi */
@@ -0,0 +1,62 @@
+/*
+ * Firmware call traces of the thinkpad-wmi debugfs interface
+ *
+ * Copyright(C) 2017 Corentin Chary <corentin.chary@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef THINKPAD_WMI_TRACE_H
+#define THINKPAD_WMI_TRACE_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "thinkpad_wmi.h"
+
+namespace thinkpad_wmi {
+
+/*
+ * One line of debugfs trace, see thinkpad_wmi_trace_call():
+ *   op instance latency_ns status input type output
+ */
+struct call {
+	std::string op;
+	unsigned instance = 0;
+	uint64_t latency_ns = 0;
+	unsigned status = 0;
+	std::string input;	/* cut before the first password */
+	char type = '-';
+	std::string output;
+};
+
+std::vector<call> parse_trace(const std::string &text);
+std::string format_call(const call &c);
+
+/*
+ * Every successful save_bios_settings must come right after a
+ * set_bios_settings of one of the saved items (names with '/' or '\'), not
+ * after another save or a set that is never saved, like the ones of the
+ * debugfs set_bios_settings file. A call repeated once right away counts
+ * once, see thinkpad_wmi_simple_call(). Returns what breaks it.
+ */
+std::vector<std::string> check_set_save(const std::vector<call> &calls,
+					const std::set<std::string> &saved);
+
+/* An auth string read back is torn if it is none of the written ones */
+bool is_torn(const std::string &value, const std::set<std::string> &written);
+
+/*
+ * A trace to load with replay=, answering discovery, selections, sets and
+ * saves of these settings, each with latency_ns.
+ */
+std::string emulate(const std::vector<setting> &settings, uint64_t latency_ns);
+
+} /* namespace thinkpad_wmi */
+
+#endif /* THINKPAD_WMI_TRACE_H */